@@ -19,19 +19,33 @@
 #include "tablet.h"
 #include "framebuffer.h"
 #include "brush.h"
+#include "stroke.h"
+#include "compositor.h"
+#include "pbo.h"
+#include "playback.h"
+#include "proxy.h"
+#include "layout.h"
+#include "bench.h"
+#include "options.h"
+#include "project.h"
+#include "journal.h"
+#include "batch.h"
+#include "export.h"
+#include "import.h"
+#include "regress.h"
+#include "sprites.h"
+#include "strokes.h"
+#include "worker.h"
 
 
-#define FRAMESX 1
-#define FRAMESY 1
-#define FRAMEST 240
-#define FRAMESTOTAL (FRAMESX*FRAMESY*FRAMEST)
-
 float interpolate(float x, float y, float a) {
     return a*x + (1-a)*y;
 }
 
 class App {
     int _dimx, _dimy, _max_rate;
+    int _max_texture_size;
+    std::vector<Layout> _layouts;
 
     SDL_Window *_window;
     SDL_GLContext _glcontext;
@@ -46,9 +60,44 @@ class App {
 
     Brush<1> _pencil_brush;
     Brush<0> _eraser_brush;
+    LiveStroke _stroke;
+    Compositor *_compositor;
+    UploadRing *_ring;
+    Worker *_worker;
+    Playback *_playback;
+    CompositeCache *_cache = nullptr;
+    // nullptr if proxies are off
+    ProxyFrames *_proxies = nullptr;
+    // proxy level playing and scrubbing are always drawn at, 0 only when
+    // full size can't keep up
+    int _proxy_level = 0;
+    ScrubPredictor _scrub;
+    int _lookahead;
+    // frames about to be drawn, the current one first
+    std::vector<int> _path;
+    // proxy level the canvas was last drawn at, 0 for full size
+    int _proxied = 0;
+    double _pack_after;
+    const char *_project_path;
+    int _keyframes;
+    const char *_save_status = "";
+    Journal *_journal;
+    StrokeLog *_strokes;
+    // the stroke being logged, committed piecewise
+    Stroke _logging;
+    // strokes of a timelapse and when to draw them, in ms of playback
+    std::vector<Stroke> _timelapse;
+    std::vector<double> _timelapse_at;
+    size_t _timelapse_pos = 0;
+    double _timelapse_speed;
+    std::chrono::steady_clock::time_point _timelapse_start;
+    double _autosave;
+    std::chrono::steady_clock::time_point _last_autosave;
+    std::future<bool> _saving;
+    std::vector<Layer> _layers;
 
 public:
-    App() {
+    App(const Options &opts) {
         SDL_Init(SDL_INIT_VIDEO|SDL_INIT_TIMER);
 
         SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
@@ -80,8 +129,140 @@ public:
 
         _renderer = SDL_CreateRenderer(_window, -1,  SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
-        _fb = new FrameBuffer(_renderer, FRAMESTOTAL, _dimx, _dimy, FRAMESX, FRAMESY);
-        _background = new Buffer(_renderer, _dimx, _dimy);
+        _compositor = new Compositor();
+        _ring = nullptr;
+        if (!opts.sync_upload && UploadRing::supported()) {
+            _ring = new UploadRing();
+        }
+        _worker = new Worker();
+        _pack_after = opts.pack_after;
+
+        // an existing project decides the number of frames, a journal
+        // left behind by a crash those of a project never saved. A
+        // timelapse starts from a blank canvas and saves nothing.
+        _project_path = opts.project;
+        _keyframes = opts.keyframes;
+        auto strokes_path = std::string(_project_path) + ".strokes";
+        _timelapse_speed = opts.timelapse;
+        if (_timelapse_speed) {
+            _timelapse = StrokeLog::strokesAfter(StrokeLog::load(strokes_path.c_str()), 0);
+            _journal = nullptr;
+            _strokes = new StrokeLog(nullptr);
+            _save_status = "(timelapse, not saved)";
+        } else {
+            _journal = new Journal(std::string(_project_path) + ".journal");
+            _strokes = new StrokeLog(strokes_path.c_str());
+        }
+        _autosave = opts.autosave;
+        _last_autosave = std::chrono::steady_clock::now();
+        Project project;
+        bool opened = access(_project_path, F_OK) == 0;
+        if (opened && !project.open(_project_path)) {
+            done = true;
+            opened = false;
+        } else if (opened && (project.getDimX() != _dimx || project.getDimY() != _dimy)) {
+            fprintf(stderr, "%s is %dx%d, the display is %dx%d\n",
+                    _project_path, project.getDimX(), project.getDimY(), _dimx, _dimy);
+            done = true;
+            opened = false;
+        }
+        JournalHeader journal;
+        bool recover = !done && _journal && _journal->recoverable(journal);
+        if (recover && (journal.dimx != (Uint32)_dimx || journal.dimy != (Uint32)_dimy)) {
+            fprintf(stderr, "The journal of %s is for a %dx%d display, ignoring it\n",
+                    _project_path, journal.dimx, journal.dimy);
+            recover = false;
+        }
+        int frames = opened ? project.getFrames() : recover ? journal.frames : opts.frames;
+        // an import running past the last frame adds frames for it
+        frames = std::max(frames, importFrames(opts.import, opts.import_to));
+
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &_max_texture_size);
+        _layouts = candidateLayouts(_dimx, _dimy, frames, _max_texture_size);
+        if (opts.bench_layouts) {
+            benchLayouts(_renderer, _dimx, _dimy, frames, _layouts);
+            done = true;
+        }
+
+        auto backend = FrameBuffer::ATLAS;
+        if (!opts.force_atlas && !opts.framesx &&
+                TextureArray::supported(_dimx, _dimy) && _compositor->supportsArrays()) {
+            backend = FrameBuffer::ARRAY;
+        }
+        Layout layout{opts.framesx, opts.framesy};
+        auto vram_budget = opts.vram_budget ? opts.vram_budget : queryVideoMemory() / 2;
+        if (layout.framesx && layout.framesy &&
+                ((long long)_dimx * layout.framesx > _max_texture_size || (long long)_dimy * layout.framesy > _max_texture_size)) {
+            fprintf(stderr, "A %dx%d layout needs textures larger than the %d pixels the GPU takes, choosing one\n",
+                    layout.framesx, layout.framesy, _max_texture_size);
+            layout = Layout{0, 0};
+        }
+        if (!layout.framesx || !layout.framesy) {
+            layout = chooseLayout(_dimx, _dimy, frames, _max_texture_size, vram_budget);
+        }
+        auto upload = opts.lock_upload ? Buffer::LOCK : Buffer::STATIC;
+        _fb = new FrameBuffer(_renderer, frames, _dimx, _dimy, layout.framesx, layout.framesy, backend, upload);
+        _background = new Buffer(_renderer, _dimx, _dimy, upload);
+        // the composite cache and proxies take their shares of video memory
+        // off the frames'
+        size_t vram_bytes = (size_t)vram_budget << 20;
+        size_t cache_bytes = opts.playback_cache ? vram_bytes / PLAYBACK_CACHE_SHARE : 0;
+        size_t proxy_bytes = opts.proxies ? vram_bytes / PROXY_TEXTURE_SHARE : 0;
+        _playback = new Playback(vram_bytes - cache_bytes - proxy_bytes);
+        _lookahead = opts.lookahead;
+        if (opts.proxies) {
+            _proxies = new ProxyFrames(_renderer, _dimx, _dimy, frames, proxy_bytes);
+            _proxy_level = opts.proxies == 2 ? 1 : opts.proxies == 4 ? 2 : 0;
+        }
+        if (opts.playback_cache && CompositeCache::supported(_renderer)) {
+            _cache = new CompositeCache(_renderer, _dimx, _dimy, frames, opts.playback_cache, cache_bytes);
+        }
+        auto memory_budget = opts.memory_budget ? opts.memory_budget : queryPhysicalMemory() / 2;
+        _fb->setMemoryBudget((size_t)memory_budget << 20, opts.scratch_dir);
+        if (opened) {
+            if (!_timelapse_speed) {
+                loadProject(project, *_fb, *_background, *_worker);
+            }
+            frame_cnt = std::max(1, std::min(project.getFrameCount(), frames));
+            frame_rate = std::max(1, std::min(project.getFrameRate(), _max_rate));
+        }
+        if (_timelapse_speed) {
+            startTimelapse();
+        }
+        Uint64 mark = 0;
+        int recovered = recover ? _journal->replay(*_fb, *_background, &mark) : 0;
+        // strokes drawn after the last batch that made it to the journal
+        int redrawn = 0;
+        if (recover) {
+            for (auto &stroke : StrokeLog::strokesAfter(StrokeLog::load(strokes_path.c_str()), mark)) {
+                redrawn += replayStroke(stroke);
+            }
+            _fb->getCurrentFrame() = 0;
+        }
+        if (recovered || redrawn) {
+            fprintf(stderr, "Recovered %d tiles and %d strokes of unsaved work\n", recovered, redrawn);
+            save();
+        } else if (!done && _journal) {
+            _journal->reset(_dimx, _dimy, _fb->getFrameCapacity(), _journal->getMark());
+            _strokes->mark(_journal->getMark());
+        }
+        if (opts.import && !done) {
+            int loaded = importSequence(opts.import, *_fb, *_background, opts.import_to, *_worker, [this] {
+                _fb->compact(*_worker, _pack_after);
+            });
+            if (loaded < 0) {
+                done = true;
+            } else {
+                fprintf(stderr, "Imported %d images from %s\n", loaded, opts.import);
+                if (opts.import_to >= 0) {
+                    frame_cnt = std::max(frame_cnt, opts.import_to + loaded);
+                }
+            }
+        }
+        if (wantsExport(opts) && !done) {
+            runExports(snapshotProject(*_fb, *_background, frame_cnt, frame_rate), opts, *_worker, onion_colors);
+            done = true;
+        }
 
         SDL_SysWMinfo wmInfo;
         SDL_VERSION(&wmInfo.version);
@@ -93,8 +274,21 @@ public:
     }
 
     ~App() {
+        logStroke();
+        if (_journal) {
+            _journal->checkpoint(*_fb, *_background, *_worker, _strokes);
+        }
+        // finishes the journal writes
+        delete _cache;
+        delete _proxies;
+        delete _playback;
+        delete _worker;
+        delete _journal;
+        delete _strokes;
         delete _background;
         delete _fb;
+        delete _ring;
+        delete _compositor;
         ImGui_ImplSdlGL2_Shutdown();
         SDL_DestroyRenderer(_renderer);
         SDL_GL_DeleteContext(_glcontext);
@@ -118,30 +312,100 @@ public:
     bool onion_next = false;
     bool onion_colors = true;
     bool background_active = false;
+    bool live_preview = true;
+    bool shader_compositor = true;
+    float predict_ms = 8;
 
     const static int PENCIL = 0;
     const static int ERASER = 1;
     int active_tool = 0;
 
 public:
-    void processEvents() {
+    void commitStroke() {
         if (background_active) {
-            processEvents(*_background);
+            commitStroke(*_background);
         } else {
-            processEvents(*_fb);
+            commitStroke(*_fb);
         }
     }
 
     template <typename Buf>
-    void processEvents(Buf &buffer) {
+    void commitStroke(Buf &buffer) {
         switch (active_tool) {
-            case PENCIL: processEvents(buffer, _pencil_brush); break;
-            case ERASER: processEvents(buffer, _eraser_brush); break;
+            case PENCIL: commitStroke(buffer, _pencil_brush); break;
+            case ERASER: commitStroke(buffer, _eraser_brush); break;
         }
     }
 
     template <typename Buf, typename Br>
-    void processEvents(Buf &buffer, Br &brush) {
+    void commitStroke(Buf &buffer, Br &brush) {
+        if (_stroke.pending()) {
+            int target = background_active ? -1 : _fb->getCurrentFrame();
+            if (_logging.tool != active_tool || _logging.frame != target) {
+                logStroke();
+            }
+            if (_logging.events.empty()) {
+                _logging.tool = active_tool;
+                _logging.frame = target;
+                _logging.start = brush.getLastPos();
+            }
+            auto &input = _stroke.getInput();
+            _logging.events.insert(_logging.events.end(), input.begin(), input.end());
+            _stroke.commit(buffer, brush);
+            dirty = true;
+        }
+        if (_stroke.empty()) {
+            logStroke();
+        }
+    }
+
+    // appends the stroke once the pen is lifted
+    void logStroke() {
+        if (!_logging.events.empty()) {
+            _strokes->append(_logging.tool, _logging.frame, _logging.start, _logging.events);
+            _logging.events.clear();
+        }
+    }
+
+    // draws a logged stroke the way it was drawn, false if it doesn't fit
+    bool replayStroke(const Stroke &stroke) {
+        return ::replayStroke(stroke, *_fb, *_background, _pencil_brush, _eraser_brush);
+    }
+
+    // Strokes are drawn on a blank canvas at SPEED times the pace they
+    // were drawn at, with pauses cut to two seconds
+    void startTimelapse() {
+        _fb->loadFrames([](int, PackedFrame&, Bounds&) { });
+        _background->setPacked(PackedFrame{}, Bounds{});
+        double at = 0;
+        Uint32 prev = 0;
+        _timelapse_at.clear();
+        for (auto &stroke : _timelapse) {
+            if (stroke.time_ms > prev) {
+                at += std::min(stroke.time_ms - prev, 2000u);
+            }
+            prev = stroke.time_ms;
+            _timelapse_at.push_back(at / _timelapse_speed);
+        }
+        _timelapse_pos = 0;
+        _timelapse_start = std::chrono::steady_clock::now();
+    }
+
+    void playTimelapse() {
+        double now = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _timelapse_start).count();
+        while (_timelapse_pos < _timelapse.size() && _timelapse_at[_timelapse_pos] <= now) {
+            auto &stroke = _timelapse[_timelapse_pos++];
+            replayStroke(stroke);
+            background_active = stroke.frame < 0;
+            dirty = true;
+        }
+    }
+
+    bool timelapsePlaying() const {
+        return _timelapse_pos < _timelapse.size();
+    }
+
+    void processEvents() {
         std::vector<XEvent> events;
 
         ImGuiIO& io = ImGui::GetIO();
@@ -163,9 +427,18 @@ public:
                             (int)interpolate(_last.y, res.y, step*1./STEPS),
                             int(interpolate(_last.pressure, res.pressure, step*1./STEPS)*norm/STEPS/5),
                         };
-                        brush.draw(in, buffer);
+                        _stroke.push(in);
+                    }
+                    if (_stroke.empty()) {
+                        _stroke.track(TabletEvent{_last.x, _last.y, int(_last.pressure*norm/STEPS/5)});
+                    }
+                    _stroke.track(TabletEvent{res.x, res.y, int(res.pressure*norm/STEPS/5)});
+                    if (res.pressure == 0) {
+                        _stroke.end();
+                    }
+                    if (!live_preview) {
+                        commitStroke();
                     }
-                    dirty = true;
                 }
                 _last = res;
             } else {
@@ -179,9 +452,10 @@ public:
 
         SDL_Event sdl_event;
         bool waited = false;
-        if (!playing) {
-            SDL_WaitEvent(&sdl_event);
-            waited = true;
+        if (!playing && !timelapsePlaying()) {
+            // wakes up now and then for the autosave, or soon if proxies
+            // stand in for frames that will be ready in a moment
+            waited = SDL_WaitEventTimeout(&sdl_event, _proxied ? 10 : 1000);
         }
         while (waited || SDL_PollEvent(&sdl_event)) {
             waited = false;
@@ -189,11 +463,21 @@ public:
             if (sdl_event.type == SDL_QUIT)
                 done = true;
             if (sdl_event.type == SDL_KEYDOWN) {
+                // pen input so far goes where it was drawn, before a key
+                // changes the frame, tool or background
+                switch (sdl_event.key.keysym.sym) {
+                    case ',': case '.': case 'b': case 'p': case 'e': commitStroke(); break;
+                }
                 switch (sdl_event.key.keysym.sym) {
                     case SDLK_SPACE: playing = !playing; break;
                     case ',': _fb->prevFrame(frame_cnt); break;
                     case '.': _fb->nextFrame(frame_cnt); break;
                     case 'q': done = true; break;
+                    case 's':
+                        if (sdl_event.key.keysym.mod & KMOD_CTRL) {
+                            save();
+                        }
+                        break;
                     case '[': onion_prev = !onion_prev; break;
                     case ']': onion_next = !onion_next; break;
                     case 'b': background_active = !background_active; break;
@@ -214,15 +498,55 @@ public:
         SDL_RenderSetViewport(_renderer, &vp);
         SDL_RenderClear(_renderer);
 
-        if (dirty) {
-            if (background_active) {
-                _background->update();
+        // whatever was drawn on is uploaded, whether it's still current or
+        // not; stays dirty if the upload buffers are all in flight
+        auto uploaded = _background->update(_ring);
+        dirty = !_fb->update(_ring) || !uploaded;
+        // played frames come from the cache once they're baked, frames
+        // that can't be drawn at full size in time from their proxies
+        auto frame = _fb->getCurrentFrame();
+        auto key = playing && _cache ? compositeKey(frame) : 0;
+        auto level = key && _cache->has(frame, key) ? 0 : proxyLevel();
+        _proxied = level && renderProxies(level) ? level : 0;
+        if (!_proxied && !key) {
+            renderCanvas();
+        } else if (!_proxied && !_cache->draw(frame, key)) {
+            if (_cache->bake(frame, key, [this](bool target) { renderCanvas(target); })) {
+                _cache->draw(frame, key);
             } else {
-                _fb->updateActive();
+                renderCanvas();
             }
-            dirty = false;
         }
-        _background->render(nullptr, nullptr);
+
+        if (active_tool == PENCIL) {
+            _stroke.render(_renderer);
+        }
+
+        renderGUI();
+        SDL_RenderPresent(_renderer);
+    }
+
+    // target is true if drawing into a texture
+    void renderCanvas(bool target=false) {
+        // texture arrays can only be drawn by the compositor
+        auto arrays = _fb->getBackend() == FrameBuffer::ARRAY;
+        if (!(shader_compositor || arrays) || !renderComposited(target)) {
+            renderLayers();
+        }
+    }
+
+    // everything the composite of frame is made of
+    Uint64 compositeKey(int frame) {
+        std::vector<Uint32> parts{(Uint32)frame_cnt, (Uint32)onion_prev, (Uint32)onion_next, (Uint32)onion_colors,
+                                  (Uint32)shader_compositor, _background->getGeneration()};
+        for (int i = -onion_prev*2; i <= onion_next*2; ++i) {
+            parts.push_back(_fb->getVersion((frame + i + frame_cnt) % frame_cnt));
+        }
+        return hashBytes((const Uint8*)parts.data(), 4 * parts.size()) | 1;
+    }
+
+    void renderLayers() {
+        _background->renderInk();
 
         for (int i = 0; i < onion_prev*2; ++i) {
             _fb->prevFrame(frame_cnt);
@@ -249,15 +573,123 @@ public:
             _fb->prevFrame(frame_cnt);
         }
         _fb->renderActive();
+    }
+
+    bool renderComposited(bool target=false) {
+        _layers.clear();
+        Layer layer;
+        _layers.push_back(_background->getLayer());
+        for (int i = 0; i < onion_prev*2; ++i) {
+            auto tint = onion_colors ? 255-(255-63)*i : 255;
+            auto g = onion_colors ? 0 : 255;
+            if (_fb->getLayer(_fb->offsetFrame(-i-1, frame_cnt), layer, tint, g, g)) {
+                _layers.push_back(layer);
+            }
+        }
+        for (int i = 0; i < onion_next*2; ++i) {
+            auto tint = onion_colors ? 255-(255-63)*i : 255;
+            auto rb = onion_colors ? 0 : 255;
+            if (_fb->getLayer(_fb->offsetFrame(i+1, frame_cnt), layer, rb, tint, rb)) {
+                _layers.push_back(layer);
+            }
+        }
+        if (_fb->getLayer(_fb->getCurrentFrame(), layer)) {
+            _layers.push_back(layer);
+        }
+        return _compositor->draw(_renderer, _layers, _dimx, _dimy, target);
+    }
 
+    // the proxy level playback is drawn at, 0 for full size
+    int playbackLevel() {
+        return !_proxies ? 0 : _proxy_level ? _proxy_level : _playback->getLevel();
+    }
 
-        renderGUI();
-        SDL_RenderPresent(_renderer);
+    // The proxy level to draw the canvas at, 0 for full size. Playing and
+    // scrubbing go by the level asked for or the one playback dropped to,
+    // frames that aren't ready are drawn from proxies rather than waited for.
+    int proxyLevel() {
+        if (!_proxies || !_stroke.empty() || dirty) {
+            return 0;
+        }
+        auto level = playing ? playbackLevel() : _scrub.scrubbing() ? _proxy_level : 0;
+        if (level) {
+            return level;
+        }
+        return _playback->ready(*_fb, _fb->getCurrentFrame(), frame_cnt, onion_prev*2, onion_next*2) ? 0 : 1;
+    }
+
+    // true if frame and its onion skins all have current proxies
+    bool hasProxies(int frame) {
+        for (int i = -onion_prev*2; i <= onion_next*2; ++i) {
+            if (!_proxies->has(*_fb, (frame + i + frame_cnt) % frame_cnt)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the background with proxies of the frames shown at level, false if
+    // one of them has no proxy
+    bool renderProxies(int level) {
+        if (!hasProxies(_fb->getCurrentFrame())) {
+            return false;
+        }
+        struct Shown {
+            int frame, r, g, b;
+        };
+        std::vector<Shown> shown;
+        for (int i = 0; i < onion_prev*2; ++i) {
+            auto tint = onion_colors ? 255-(255-63)*i : 255;
+            auto g = onion_colors ? 0 : 255;
+            shown.push_back(Shown{_fb->offsetFrame(-i-1, frame_cnt), tint, g, g});
+        }
+        for (int i = 0; i < onion_next*2; ++i) {
+            auto tint = onion_colors ? 255-(255-63)*i : 255;
+            auto rb = onion_colors ? 0 : 255;
+            shown.push_back(Shown{_fb->offsetFrame(i+1, frame_cnt), rb, tint, rb});
+        }
+        shown.push_back(Shown{_fb->getCurrentFrame(), 255, 255, 255});
+        if (shader_compositor) {
+            _layers.clear();
+            _layers.push_back(_background->getLayer());
+            Layer layer;
+            for (auto &s : shown) {
+                if (_proxies->getLayer(*_fb, s.frame, level, layer, s.r, s.g, s.b)) {
+                    _layers.push_back(layer);
+                }
+            }
+            if (_compositor->draw(_renderer, _layers, _dimx, _dimy)) {
+                return true;
+            }
+        }
+        _background->renderInk();
+        for (auto &s : shown) {
+            _proxies->render(*_fb, s.frame, level, s.r, s.g, s.b);
+        }
+        return true;
+    }
+
+    // commits pending pen input with the frame, tool and background it was
+    // drawn with, which widgets may have changed since
+    void commitStrokeAs(int frame, int tool, bool background) {
+        if (frame == _fb->getCurrentFrame() && tool == active_tool && background == background_active) {
+            return;
+        }
+        std::swap(frame, _fb->getCurrentFrame());
+        std::swap(tool, active_tool);
+        std::swap(background, background_active);
+        commitStroke();
+        std::swap(frame, _fb->getCurrentFrame());
+        std::swap(tool, active_tool);
+        std::swap(background, background_active);
     }
 
     void renderGUI() {
         glUseProgram(0);
         ImGui_ImplSdlGL2_NewFrame(_window);
+        auto frame = _fb->getCurrentFrame();
+        auto tool = active_tool;
+        auto background = background_active;
         if (!_tablet) {
             ImGui::Begin("Select your tablet");
             static int tablet_id = 0;
@@ -275,6 +707,19 @@ public:
         if (ImGui::Button("Quit")) {
             done = true;
         }
+        ImGui::SameLine();
+        if (ImGui::Button("Save")) {
+            save();
+        }
+        ImGui::SameLine();
+        ImGui::Text("%s %s", _project_path, _save_status);
+        if (_timelapse_speed) {
+            ImGui::Text("timelapse: %d/%d strokes", (int)_timelapse_pos, (int)_timelapse.size());
+            ImGui::SameLine();
+            if (ImGui::Button("Restart")) {
+                startTimelapse();
+            }
+        }
         ImGui::SliderInt("frame_rate", &frame_rate, 1, _max_rate);
         ImGui::SliderInt("frame_cnt", &frame_cnt, 1, _fb->getFrameCapacity());
         ImGui::SliderInt("frame", &_fb->getCurrentFrame(), 0, frame_cnt - 1);
@@ -295,23 +740,147 @@ public:
         ImGui::Checkbox("onion_next", &onion_next);
         ImGui::Checkbox("onion_colors", &onion_colors);
         ImGui::Checkbox("background_active", &background_active);
+        if (_fb->getBackend() == FrameBuffer::ATLAS) {
+            ImGui::Checkbox("shader_compositor", &shader_compositor);
+            renderLayoutGUI();
+        }
+        ImGui::Text("memory: %.1f of %.0f MB, %d/%d buffers packed",
+                    (_fb->getBytes() + _background->getBytes()) / 1048576., _fb->getMemoryBudget() / 1048576.,
+                    _fb->getPackedCount(), _fb->getBufferCount());
+        ImGui::Text("spilled: %d buffers, %.1f MB", _fb->getSpilledCount(), _fb->getSpilledBytes() / 1048576.);
+        auto &health = _playback->getHealth();
+        ImGui::Text("playback: %d/%d frames ready ahead, %d pending, %zu stalls, %zu late ticks, %.0f MB textures",
+                    health.ready, health.window, health.pending, health.stalls, health.late,
+                    _fb->getTextureBytes() / 1048576.);
+        if (_proxies) {
+            ImGui::Text("proxies: %d/%d frames, %.0f MB, %.0f MB textures, %zu ticks played from them",
+                        _proxies->getBuiltCount(*_fb), _fb->getFrameCapacity(), _proxies->getBytes() / 1048576.,
+                        _proxies->getTextureBytes() / 1048576., health.proxied);
+            const char *levels[] = {"full size", "half size", "quarter size"};
+            ImGui::Text("drawn at %s, playback at %s, scrubbing at %.0f frames/s", levels[_proxied],
+                        levels[playbackLevel()], _scrub.getVelocity());
+        }
+        if (_cache) {
+            ImGui::Text("playback cache: %d frames baked, %.0f MB", _cache->getBakedCount(),
+                        _cache->getBytes() / 1048576.);
+        }
+        const char *priorities[] = {"interactive", "background", "batch"};
+        for (int p = 0; p < Worker::PRIORITIES; ++p) {
+            auto stats = _worker->getStats((Worker::Priority)p);
+            ImGui::Text("%s jobs: %zu queued, %zu running, %zu done, %zu cancelled, %.1fms wait", priorities[p],
+                        stats.queued, stats.running, stats.done, stats.cancelled,
+                        stats.done ? stats.waited * 1000 / stats.done : 0.);
+        }
         ImGui::RadioButton("pencil", &active_tool, PENCIL);
         ImGui::SameLine();
         ImGui::RadioButton("eraser", &active_tool, ERASER);
+        ImGui::Checkbox("live_preview", &live_preview);
+        if (live_preview) {
+            ImGui::SameLine();
+            ImGui::SliderFloat("predict_ms", &predict_ms, 0, 30);
+        }
+        commitStrokeAs(frame, tool, background);
         ImGui::Render();
     }
 
+    void renderLayoutGUI() {
+        auto current = _fb->getLayout();
+        char label[64];
+        snprintf(label, sizeof label, "%dx%d", current.framesx, current.framesy);
+        if (ImGui::BeginCombo("layout", label)) {
+            for (auto &layout : _layouts) {
+                snprintf(label, sizeof label, "%dx%d (%d textures)",
+                         layout.framesx, layout.framesy, layout.textures(_fb->getFrameCapacity()));
+                bool selected = layout.framesx == current.framesx && layout.framesy == current.framesy;
+                if (ImGui::Selectable(label, selected)) {
+                    _fb->setLayout(layout);
+                }
+            }
+            ImGui::EndCombo();
+        }
+    }
+
+    // the project is written on the worker, the GUI shows when it's done
+    void save() {
+        if (!_journal || _saving.valid()) {
+            return;
+        }
+        logStroke();
+        _saving = _journal->compact(_project_path, *_fb, *_background, frame_cnt, frame_rate, _keyframes,
+                                    *_worker, _strokes);
+        _save_status = "(saving)";
+    }
+
+    // journals what was drawn every few seconds, folds the journal into
+    // the project once it grows large
+    void autosave() {
+        if (_saving.valid() && _saving.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            _save_status = _saving.get() ? "(saved)" : "(saving failed)";
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (!_journal || !_autosave || now - _last_autosave < std::chrono::duration<double>(_autosave)) {
+            return;
+        }
+        _last_autosave = now;
+        _journal->checkpoint(*_fb, *_background, *_worker, _strokes);
+        if (_journal->getSize() > JOURNAL_COMPACT_BYTES) {
+            save();
+        }
+    }
+
+    // frames about to be drawn are loaded, decoded and uploaded ahead of time
+    void prefetch() {
+        auto frame = _fb->getCurrentFrame();
+        _path.assign(1, frame);
+        if (playing) {
+            for (int k = 1; k <= std::min(_lookahead, frame_cnt - 1); ++k) {
+                _path.push_back((frame + k) % frame_cnt);
+            }
+        } else {
+            _scrub.predict(frame, frame_cnt, _lookahead, _path);
+        }
+        _playback->update(*_fb, *_worker, _path, frame_cnt, onion_prev*2, onion_next*2,
+                          [this](int frame) {
+                              return playing && ((_cache && _cache->has(frame, compositeKey(frame))) ||
+                                                 (playbackLevel() && hasProxies(frame)));
+                          });
+    }
+
     void run() {
         while (!done) {
             auto start = std::chrono::high_resolution_clock::now();
 
             processEvents();
+            _stroke.predict_ms = predict_ms;
+            auto frame = _fb->getCurrentFrame();
+            if (playing) {
+                _scrub.stop();
+            } else {
+                _scrub.update(frame, frame_cnt);
+                _playback->stop();
+            }
+            if (playing && !(_cache && _cache->has(frame, compositeKey(frame)))) {
+                _playback->draw(*_fb, frame, frame_cnt, onion_prev*2, onion_next*2);
+            }
             render();
+            // rasterize what the overlay has shown, off the pen-to-ink path
+            commitStroke();
+            if (timelapsePlaying()) {
+                playTimelapse();
+            }
+            _fb->compact(*_worker, _pack_after);
+            if (_proxies) {
+                _proxies->update(*_fb, *_worker, _fb->getCurrentFrame());
+                _fb->setOtherBytes(_proxies->getBytes());
+            }
+            prefetch();
+            autosave();
 
             if (playing) {
                 _fb->nextFrame(frame_cnt);
                 auto end = std::chrono::high_resolution_clock::now();
                 auto elapsed = end - start;
+                _playback->tick(elapsed > std::chrono::microseconds(1000000/frame_rate), _proxied);
                 std::this_thread::sleep_for(std::chrono::microseconds(1000000/frame_rate)-elapsed);
             } else {
                 /* SDL_Delay(16); */
@@ -0,0 +1,297 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <SDL2/SDL.h>
+
+#include "bounds.h"
+#include "brush.h"
+#include "buffer.h"
+#include "codec.h"
+#include "export.h"
+#include "framebuffer.h"
+#include "import.h"
+#include "journal.h"
+#include "options.h"
+#include "project.h"
+#include "sprites.h"
+#include "strokes.h"
+#include "tiles.h"
+#include "worker.h"
+
+
+template <typename Buf, typename Br>
+bool replayStroke(const Stroke &stroke, Buf &buffer, Br &brush) {
+    brush.setLastPos(stroke.start);
+    for (auto &evt : stroke.events) {
+        brush.draw(evt, buffer);
+    }
+    return true;
+}
+
+// Draws a logged stroke again, tool 0 with the pencil and 1 with the
+// eraser. Strokes on frames past the end are skipped.
+template <typename Pencil, typename Eraser>
+bool replayStroke(const Stroke &stroke, FrameBuffer &fb, Buffer &background, Pencil &pencil, Eraser &eraser) {
+    if (stroke.frame >= fb.getFrameCapacity()) {
+        return false;
+    }
+    if (stroke.frame >= 0) {
+        fb.getCurrentFrame() = stroke.frame;
+    }
+    switch (stroke.tool) {
+        case 0: return stroke.frame >= 0 ? replayStroke(stroke, fb, pencil) : replayStroke(stroke, background, pencil);
+        case 1: return stroke.frame >= 0 ? replayStroke(stroke, fb, eraser) : replayStroke(stroke, background, eraser);
+    }
+    return false;
+}
+
+// The snapshot fitted to a dimx x dimy canvas: centered, and shrunk by a
+// box filter if it's larger. Frames are scaled on the worker.
+ProjectSnapshot resizeSnapshot(const ProjectSnapshot &snapshot, int dimx, int dimy, Worker &worker) {
+    ProjectSnapshot res = snapshot;
+    res.dimx = dimx;
+    res.dimy = dimy;
+    TileGrid from(snapshot.dimx, snapshot.dimy), to(dimx, dimy);
+    worker.parallelFor(res.frames.size(), [&](int f) {
+        res.frames[f] = PackedFrame{};
+        res.inks[f] = Bounds{};
+        if (snapshot.frames[f].empty() || snapshot.inks[f].empty()) {
+            return;
+        }
+        std::vector<Uint8> src(4ull * snapshot.dimx * snapshot.dimy), dst(4ull * dimx * dimy), row(4 * snapshot.dimx);
+        unpackPixels(snapshot.frames[f], src.data(), 4 * snapshot.dimx, from);
+        RowScaler scaler(snapshot.dimx, snapshot.dimy, dimx, dimy, dst.data());
+        for (int y = 0; y < snapshot.dimy; ++y) {
+            // swapping red and blue goes both ways
+            rgbaToFrame(&src[4ull * snapshot.dimx * y], row.data(), snapshot.dimx);
+            scaler.row(row.data());
+        }
+        auto area = scaler.area();
+        for (int y = area.y0; y <= area.y1; ++y) {
+            for (int x = area.x0; x <= area.x1; ++x) {
+                if (dst[4ull * (dimx * y + x) + 3]) {
+                    res.inks[f].extend(Bounds{x, y, x, y});
+                }
+            }
+        }
+        if (!res.inks[f].empty()) {
+            res.frames[f] = packPixels(dst.data(), 4 * dimx, to);
+        }
+    });
+    return res;
+}
+
+// Frames composited as on screen side by side, columns to a row, each
+// shrunk by a whole factor so that a row is at most max_width wide.
+// Frames are composited on the worker.
+bool exportContactSheet(const ProjectSnapshot &snapshot, const ExportOptions &opts, const char *path,
+                        int columns, int max_width, Worker &worker) {
+    int dimx = snapshot.dimx, dimy = snapshot.dimy;
+    int count = std::max(1, std::min<int>(snapshot.frame_cnt, snapshot.frames.size() - 1));
+    columns = std::max(1, std::min(columns, count));
+    int rows = (count + columns - 1) / columns;
+    int factor = std::max(1, (dimx * columns + max_width - 1) / max_width);
+    int cw = dimx / factor, ch = dimy / factor;
+    int w = cw * columns, h = ch * rows;
+    std::vector<Uint8> sheet(4ull * w * h);
+    worker.parallelFor(count, [&](int f) {
+        std::vector<Uint8> canvas(4ull * dimx * dimy), scratch;
+        compositeFrame(snapshot, f, opts, canvas.data(), scratch);
+        int offx = cw * (f % columns), offy = ch * (f / columns);
+        for (int y = 0; y < ch; ++y) {
+            auto dst = &sheet[4ull * (w * (offy + y) + offx)];
+            for (int x = 0; x < cw; ++x, dst += 4) {
+                int sum[3] = {0, 0, 0};
+                for (int sy = y * factor; sy < (y + 1) * factor; ++sy) {
+                    auto src = &canvas[4ull * (dimx * sy + x * factor)];
+                    for (int sx = 0; sx < factor; ++sx, src += 4) {
+                        sum[0] += src[2];
+                        sum[1] += src[1];
+                        sum[2] += src[0];
+                    }
+                }
+                for (int c = 0; c < 3; ++c) {
+                    dst[c] = (sum[c] + factor * factor / 2) / (factor * factor);
+                }
+                dst[3] = 255;
+            }
+        }
+    });
+    return writePNG(path, sheet.data(), w, h);
+}
+
+// "-" streams to stdout, e.g. into an encoder
+bool exportVideo(const ProjectSnapshot &snapshot, const ExportOptions &opts, const char *path, Worker &worker,
+                 bool (*write)(const ProjectSnapshot&, const ExportOptions&, Worker&, FILE*)) {
+    bool to_stdout = !strcmp(path, "-");
+    auto out = to_stdout ? stdout : fopen(path, "wb");
+    if (!out) {
+        perror(path);
+        return false;
+    }
+    bool ok = write(snapshot, opts, worker, out);
+    if (!to_stdout && fclose(out)) {
+        ok = false;
+    }
+    return ok;
+}
+
+bool wantsExport(const Options &opts) {
+    return opts.export_y4m || opts.export_gif || opts.export_sprites || opts.contact_sheet;
+}
+
+// Every export opts asks for, one after the other since each of them
+// already keeps the worker busy
+bool runExports(const ProjectSnapshot &snapshot, const Options &opts, Worker &worker, bool onion_colors=true) {
+    ExportOptions video;
+    video.onion_prev = video.onion_next = opts.export_onion;
+    video.onion_colors = onion_colors;
+    ExportOptions contact = video;
+    contact.onion_prev = contact.onion_next = true;
+    struct Export {
+        const char *path;
+        std::function<bool()> run;
+    } exports[] = {
+        {opts.export_y4m, [&] { return exportVideo(snapshot, video, opts.export_y4m, worker, exportY4M); }},
+        {opts.export_gif, [&] { return exportVideo(snapshot, video, opts.export_gif, worker, exportGIF); }},
+        {opts.export_sprites, [&] { return exportSprites(snapshot, opts.export_sprites, opts.sheet_size, worker); }},
+        {opts.contact_sheet, [&] {
+            return exportContactSheet(snapshot, contact, opts.contact_sheet, opts.contact_columns, opts.sheet_size,
+                                      worker);
+        }},
+    };
+    bool ok = true;
+    for (auto &e : exports) {
+        if (!e.path) {
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (!e.run()) {
+            fprintf(stderr, "Exporting to %s failed\n", e.path);
+            ok = false;
+            continue;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "Exported %d frames to %s in %.2fs\n", snapshot.frame_cnt, e.path, elapsed.count());
+    }
+    return ok;
+}
+
+// Opens the project, applies what opts asks for and exits, all without a
+// display: frames are only ever decoded and drawn in memory. The project
+// is saved to save_as, or over itself, only if something changed it.
+int runBatch(const Options &opts) {
+    Project project;
+    if (access(opts.project, F_OK) != 0) {
+        fprintf(stderr, "%s: no such project\n", opts.project);
+        return 1;
+    }
+    if (!project.open(opts.project)) {
+        return 1;
+    }
+    int dimx = project.getDimX(), dimy = project.getDimY(), frames = project.getFrames();
+    frames = std::max(frames, importFrames(opts.import, opts.import_to));
+    // this thread mostly waits on it, so it gets every core
+    Worker worker(std::thread::hardware_concurrency());
+    FrameBuffer fb(nullptr, frames, dimx, dimy, 1, 1);
+    Buffer background(nullptr, dimx, dimy);
+    if (opts.memory_budget) {
+        fb.setMemoryBudget((size_t)opts.memory_budget << 20, opts.scratch_dir);
+    }
+    loadProject(project, fb, background, worker);
+    int frame_cnt = std::max(1, std::min(project.getFrameCount(), frames));
+    int frame_rate = std::max(1, project.getFrameRate());
+    bool changed = false;
+
+    // unsaved work a crash left in the journal goes in first, as when the
+    // project is opened with a window, and the journal goes once it's saved
+    auto journal_path = std::string(opts.project) + ".journal";
+    bool recovered = false;
+    if (access(journal_path.c_str(), F_OK) == 0) {
+        Journal journal(journal_path);
+        JournalHeader header;
+        bool recover = journal.recoverable(header);
+        if (recover && (header.dimx != (Uint32)dimx || header.dimy != (Uint32)dimy)) {
+            fprintf(stderr, "The journal of %s is for a %dx%d canvas, not running on a project with unsaved work\n",
+                    opts.project, header.dimx, header.dimy);
+            return 1;
+        }
+        Uint64 mark = 0;
+        int tiles = journal.replay(fb, background, &mark);
+        int redrawn = 0;
+        // strokes drawn after the last batch that made it to the journal
+        if (recover) {
+            auto path = std::string(opts.project) + ".strokes";
+            Brush<1> pencil;
+            Brush<0> eraser;
+            for (auto &stroke : StrokeLog::strokesAfter(StrokeLog::load(path.c_str()), mark)) {
+                redrawn += replayStroke(stroke, fb, background, pencil, eraser);
+            }
+        }
+        if (tiles || redrawn) {
+            fprintf(stderr, "Recovered %d tiles and %d strokes of unsaved work\n", tiles, redrawn);
+            recovered = changed = true;
+        }
+    }
+
+    if (opts.redraw_strokes) {
+        auto path = std::string(opts.project) + ".strokes";
+        auto strokes = StrokeLog::strokesAfter(StrokeLog::load(path.c_str()), 0);
+        fb.loadFrames([](int, PackedFrame&, Bounds&) { });
+        background.setPacked(PackedFrame{}, Bounds{});
+        Brush<1> pencil;
+        Brush<0> eraser;
+        int drawn = 0;
+        for (auto &stroke : strokes) {
+            drawn += replayStroke(stroke, fb, background, pencil, eraser);
+        }
+        fprintf(stderr, "Redrew %d strokes\n", drawn);
+        changed = true;
+    }
+    if (opts.import) {
+        int loaded = importSequence(opts.import, fb, background, opts.import_to, worker, [] { });
+        if (loaded < 0) {
+            return 1;
+        }
+        fprintf(stderr, "Imported %d images from %s\n", loaded, opts.import);
+        if (opts.import_to >= 0) {
+            frame_cnt = std::max(frame_cnt, opts.import_to + loaded);
+        }
+        changed = true;
+    }
+    auto snapshot = snapshotProject(fb, background, frame_cnt, frame_rate,
+                                    opts.keyframes ? opts.keyframes : project.getKeyframes());
+    if (opts.resize_x) {
+        auto start = std::chrono::steady_clock::now();
+        snapshot = resizeSnapshot(snapshot, opts.resize_x, opts.resize_y, worker);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "Resized %dx%d to %dx%d in %.2fs\n", dimx, dimy, opts.resize_x, opts.resize_y,
+                elapsed.count());
+        changed = true;
+    }
+
+    bool ok = runExports(snapshot, opts, worker);
+    if (changed || opts.save_as) {
+        auto path = opts.save_as ? opts.save_as : opts.project;
+        if (!writeProject(path, snapshot)) {
+            fprintf(stderr, "Saving %s failed\n", path);
+            ok = false;
+        } else if (recovered && !strcmp(path, opts.project) && unlink(journal_path.c_str()) != 0) {
+            perror(journal_path.c_str());
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <GL/glew.h>
+
+#include "framebuffer.h"
+#include "layout.h"
+
+
+struct LayoutBench {
+    Layout layout;
+    double upload_fps;
+    double playback_fps;
+};
+
+// Fills a throwaway FrameBuffer per layout with a few strokes per frame,
+// then times uploading every frame once and playing back two loops.
+std::vector<LayoutBench> benchLayouts(SDL_Renderer *renderer, int dimx, int dimy, int frames,
+                                      const std::vector<Layout> &layouts) {
+    typedef std::chrono::high_resolution_clock Clock;
+    auto seconds = [](Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+
+    std::vector<LayoutBench> res;
+    for (auto &layout : layouts) {
+        FrameBuffer fb(renderer, frames, dimx, dimy, layout.framesx, layout.framesy);
+        for (int frame = 0; frame < frames; ++frame) {
+            for (int y = 0; y < dimy; ++y) {
+                int x = (y + frame * 8) % dimx;
+                int w = std::min(4, dimx - x);
+                memset(fb.getPixel(x, y), 255, 4 * w);
+                fb.touch(x, y, x + w - 1, y, true);
+            }
+            fb.nextFrame();
+        }
+
+        glFinish();
+        auto start = Clock::now();
+        for (int frame = 0; frame < frames; ++frame) {
+            fb.updateActive();
+            fb.nextFrame();
+        }
+        SDL_RenderFlush(renderer);
+        glFinish();
+        double upload = frames / seconds(start);
+
+        start = Clock::now();
+        for (int frame = 0; frame < 2 * frames; ++frame) {
+            SDL_RenderClear(renderer);
+            fb.renderActive();
+            fb.nextFrame();
+        }
+        SDL_RenderFlush(renderer);
+        glFinish();
+        double playback = 2 * frames / seconds(start);
+
+        res.push_back(LayoutBench{layout, upload, playback});
+        printf("%dx%d: %d textures, %lld MB, upload %.1f frames/s, playback %.1f frames/s\n",
+               layout.framesx, layout.framesy, layout.textures(frames),
+               layout.bytes(frames, dimx, dimy) >> 20, upload, playback);
+        fflush(stdout);
+    }
+    return res;
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef _BOUNDS_H
+#define _BOUNDS_H
+
+#include <algorithm>
+#include <climits>
+
+#include <SDL2/SDL.h>
+
+
+// Inclusive pixel rectangle, empty by default
+struct Bounds {
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+
+    bool empty() const {
+        return x0 > x1 || y0 > y1;
+    }
+
+    void extend(const Bounds &o) {
+        x0 = std::min(x0, o.x0);
+        y0 = std::min(y0, o.y0);
+        x1 = std::max(x1, o.x1);
+        y1 = std::max(y1, o.y1);
+    }
+
+    bool intersects(const Bounds &o) const {
+        return !empty() && !o.empty() &&
+            x0 <= o.x1 && o.x0 <= x1 && y0 <= o.y1 && o.y0 <= y1;
+    }
+
+    Bounds clipped(int w, int h) const {
+        Bounds res{std::max(x0, 0), std::max(y0, 0), std::min(x1, w-1), std::min(y1, h-1)};
+        if (res.empty()) {
+            return Bounds{};
+        }
+        return res;
+    }
+
+    SDL_Rect rect(int offx=0, int offy=0) const {
+        return SDL_Rect{x0 + offx, y0 + offy, x1 - x0 + 1, y1 - y0 + 1};
+    }
+};
+
+// Bounding box of the non-zero pixels of a region. Drawing grows it right
+// away, erasing only marks it stale: it's rescanned the next time someone
+// asks for it, and only within the old box since erasing can't grow it.
+class InkBounds {
+    Bounds _box;
+    bool _stale = false;
+
+public:
+    void draw(const Bounds &b) {
+        if (!b.empty()) {
+            _box.extend(b);
+        }
+    }
+
+    void erase(const Bounds &b) {
+        if (_box.intersects(b)) {
+            _stale = true;
+        }
+    }
+
+    bool stale() const {
+        return _stale;
+    }
+
+    // for when the pixels were replaced wholesale
+    void rescan(int w, int h) {
+        _box = Bounds{0, 0, w - 1, h - 1};
+        _stale = true;
+    }
+
+    void reset() {
+        _box = Bounds{};
+        _stale = false;
+    }
+
+    void set(const Bounds &b) {
+        _box = b;
+        _stale = false;
+    }
+
+    // pixels point at the top-left corner of the region
+    const Bounds &get(const Uint8 *pixels, int pitch) {
+        if (!_stale) {
+            return _box;
+        }
+        Bounds res;
+        for (int y = _box.y0; y <= _box.y1; ++y) {
+            auto row = reinterpret_cast<const Uint32*>(pixels + y * pitch);
+            int x = _box.x0;
+            while (x <= _box.x1 && !row[x]) {
+                ++x;
+            }
+            if (x > _box.x1) {
+                continue;
+            }
+            int last = _box.x1;
+            while (!row[last]) {
+                --last;
+            }
+            res.extend(Bounds{x, y, last, y});
+        }
+        _box = res;
+        _stale = false;
+        return _box;
+    }
+};
+
+#endif
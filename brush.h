@@ -51,13 +51,22 @@ struct Vec {
 
 template<int weight>
 class Brush {
-    TabletEvent _last_pos;
+    TabletEvent _last_pos{0, 0, 0};
 
     double interpolate(double x, double y, double a) {
         return a*x + (1-a)*y;
     }
 
 public:
+    // strokes start from where the last one left the brush
+    TabletEvent getLastPos() const {
+        return _last_pos;
+    }
+
+    void setLastPos(TabletEvent pos) {
+        _last_pos = pos;
+    }
+
     template<typename Buf>
     void draw(TabletEvent res, Buf &buffer) {
         auto p = Vec(_last_pos), c = Vec(res);
@@ -139,6 +148,7 @@ public:
         double mxy = std::max(p1.y, std::max(p2.y, std::max(c1.y, c2.y)));
 
         warnock(floor(mnx), floor(mny), ceil(mxx), ceil(mxy), 0);
+        buffer.touch(floor(mnx), floor(mny), ceil(mxx), ceil(mxy), weight);
 
         _last_pos = res;
     }
@@ -1,32 +1,225 @@
 #ifndef _BUFFER_H
 #define _BUFFER_H
 
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
 #include <SDL2/SDL.h>
 
+#include "bounds.h"
+#include "codec.h"
+#include "compositor.h"
+#include "pbo.h"
+#include "spill.h"
+#include "tiles.h"
+#include "worker.h"
 
+
+// Pixels of a Buffer are either raw (_pixels) or, for buffers nobody has
+// used for a while, packed into RLE tiles (_packed). Packed buffers can
+// be spilled to a SpillFile when memory runs short. Packing, spilling and
+// loading run on a Worker; getPixel and friends unpack on demand.
 class Buffer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // STATIC: dirty tiles go straight from _pixels to the driver, the
+    //         texture has no SDL-side copy of the pixels
+    // LOCK:   dirty tiles are written into the locked streaming texture
+    enum Upload { STATIC, LOCK };
+
+private:
     SDL_Renderer *_renderer;
     int _dimx, _dimy;
     Uint8 *_pixels;
     SDL_Texture *_texture;
+    Upload _upload;
+    InkBounds _ink;
+    TileMask _dirty;
+    // written since the journal last took them
+    TileMask _unsaved;
+    bool _pbo_failed = false;
+    std::vector<SDL_Rect> _rects;
+    std::vector<size_t> _offsets;
 
-public:
-    Buffer(SDL_Renderer *renderer, int dimx, int dimy) :
-        _renderer(renderer), _dimx(dimx), _dimy(dimy)
-    {
+    PackedFrame _packed;
+    std::future<PackedFrame> _packing;
+    unsigned _generation = 0, _packing_generation = 0;
+    Clock::time_point _last_used = Clock::now();
+
+    SpillFile *_spill_file = nullptr;
+    SpillFile::Slot _slot;
+    bool _spilled = false;
+    // tiles other frames hold too, or that are mapped, stay in memory
+    // while the rest of the frame is spilled: the blob refers to them
+    std::vector<TileRef> _spill_kept, _spilling_kept;
+    // the spilled tiles couldn't be read back: the buffer stays spilled,
+    // is never packed again and can't be saved
+    bool _load_failed = false;
+    std::future<bool> _spilling;
+    Worker::CancelToken _loading;
+    // packed tiles decoded ahead of the next view()
+    std::future<std::vector<Uint8>> _decoding;
+    unsigned _decoding_generation = 0;
+    Worker::CancelToken _decode_cancel;
+
+    // reads the spilled tiles into packed, false if they couldn't be
+    bool _readSpilled(PackedFrame &packed) {
+        if (_spill_file->read(_slot, packed, &_spill_kept)) {
+            return true;
+        }
+        packed = PackedFrame{};
+        if (!_load_failed) {
+            fprintf(stderr, "Can't read a spilled frame back, it won't be saved\n");
+        }
+        _load_failed = true;
+        return false;
+    }
+
+    // Waits for a pending load or reads the spilled tiles right away.
+    // False if they couldn't be read, the buffer is blank then.
+    bool _ensureLoaded() {
+        if (_packing.valid() && !_pixels) {
+            finishPack(true);
+        }
+        if (_spilled && !_load_failed) {
+            if (!_readSpilled(_packed)) {
+                return false;
+            }
+            _spilled = false;
+            _spill_kept.clear();
+        }
+        return !_load_failed;
+    }
+
+    // The pixels decoded on the worker if they're done and still current.
+    // A decode that isn't done is dropped, waiting for it could take longer
+    // than decoding here.
+    bool _takeDecoded(std::vector<Uint8> &pixels) {
+        if (!_decoding.valid()) {
+            return false;
+        }
+        if (_decoding.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            cancelDecode();
+            return false;
+        }
+        auto decoded = _decoding.get();
+        _decode_cancel = nullptr;
+        if (decoded.empty() || _decoding_generation != _generation) {
+            return false;
+        }
+        pixels.swap(decoded);
+        return true;
+    }
+
+    void _ensurePixels() {
+        if (_packing.valid()) {
+            finishPack(true);
+        }
+        if (_pixels) {
+            return;
+        }
+        // the tiles are still here, whatever was written is stale now
+        if (_spilling.valid()) {
+            _spilling.get();
+            _spilling_kept.clear();
+        }
         _pixels = new Uint8[_dimx*_dimy*4];
+        // blank if the tiles are lost, there's something to draw on at least
+        if (!_ensureLoaded()) {
+            memset(_pixels, 0, _dimx*_dimy*4);
+            return;
+        }
+        unpackPixels(_packed, _pixels, getPitch(), _dirty);
+        _packed = PackedFrame{};
+    }
+
+    // textures of packed buffers are dropped, they come back on first use
+    void _ensureTexture() {
+        if (_texture || !_renderer) {
+            return;
+        }
+        // finishing a pack drops textures, so that goes first
+        auto pixels = view();
+        _createTexture();
+        if (_pixels) {
+            _dirty.markAll();
+            update();
+            return;
+        }
+        SDL_UpdateTexture(_texture, nullptr, pixels, getPitch());
+    }
+
+    void _createTexture() {
         _texture = SDL_CreateTexture(
-            renderer,
+            _renderer,
             SDL_PIXELFORMAT_ARGB8888,
-            SDL_TEXTUREACCESS_STREAMING,
+            _upload == LOCK ? SDL_TEXTUREACCESS_STREAMING : SDL_TEXTUREACCESS_STATIC,
             _dimx, _dimy);
         SDL_SetTextureBlendMode(_texture, SDL_BLENDMODE_ADD);
     }
 
+    bool _updateStaged(UploadRing &ring) {
+        _rects.clear();
+        _dirty.forEachSpan([this](const SDL_Rect &rect) {
+            _rects.push_back(rect);
+        });
+        if (!ring.stage(_pixels, getPitch(), _rects, _offsets)) {
+            return false;
+        }
+        SDL_RenderFlush(_renderer);
+        SDL_GL_BindTexture(_texture, nullptr, nullptr);
+        GLint bound;
+        glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+        if (bound) {
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            for (size_t i = 0; i < _rects.size(); ++i) {
+                auto &rect = _rects[i];
+                glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.w, rect.h,
+                                GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, (const void*)_offsets[i]);
+            }
+        }
+        SDL_GL_UnbindTexture(_texture);
+        ring.submit();
+        // rectangle textures go through SDL from now on
+        _pbo_failed = !bound;
+        return bound;
+    }
+
+public:
+    // the buffer may hold cellx x celly frames, each gets a tile grid of its own
+    Buffer(SDL_Renderer *renderer, int dimx, int dimy, Upload upload=STATIC, int cellx=0, int celly=0) :
+        _renderer(renderer), _dimx(dimx), _dimy(dimy), _upload(upload), _dirty(dimx, dimy, cellx, celly),
+        _unsaved(dimx, dimy, cellx, celly)
+    {
+        // starts out blank and packed, pixels and texture are made on
+        // first use. Without a renderer the buffer is CPU-only and someone
+        // else takes care of getting the pixels on screen.
+        _pixels = nullptr;
+        _texture = nullptr;
+    }
+
     ~Buffer() {
-        SDL_DestroyTexture(_texture);
+        // the worker may still be reading the pixels
+        if (_packing.valid()) {
+            _packing.wait();
+        }
+        if (_spilling.valid()) {
+            _spilling.wait();
+        }
+        if (_spill_file) {
+            _spill_file->release(_slot);
+        }
+        if (_texture) {
+            SDL_DestroyTexture(_texture);
+        }
         delete[] _pixels;
     }
 
@@ -34,19 +227,545 @@ public:
         if (y < 0 || y >= _dimy || x < 0 || x >= _dimx) {
             return 0;
         }
+        if (!_pixels || _packing.valid()) {
+            _ensurePixels();
+        }
         return &_pixels[4 * (x + _dimx * y)];
     }
 
+    bool isPacked() const {
+        return !_pixels;
+    }
+
+    bool isPacking() const {
+        return _packing.valid();
+    }
+
+    bool isSpilled() const {
+        return _spilled;
+    }
+
+    bool isSpilling() const {
+        return _spilling.valid();
+    }
+
+    // true if the spilled tiles were lost, see _load_failed
+    bool isDamaged() const {
+        return _load_failed;
+    }
+
+    size_t getSpilledBytes() const {
+        return _spilled ? _slot.size : 0;
+    }
+
+    bool hasTexture() const {
+        return _texture;
+    }
+
+    // CPU memory held by the pixels, a decode on the way holds the room
+    // of the pixels it makes already
+    size_t getBytes() const {
+        if (_pixels) {
+            return getRawBytes();
+        }
+        return _packed.charged() + chargedBytes(_spill_kept) + (_decoding.valid() ? getRawBytes() : 0);
+    }
+
+    // CPU memory the pixels take unpacked
+    size_t getRawBytes() const {
+        return 4ull * _dimx * _dimy;
+    }
+
+    void use() {
+        _last_used = Clock::now();
+    }
+
+    // changes whenever the pixels do
+    unsigned getGeneration() const {
+        return _generation;
+    }
+
+    Clock::time_point lastUsed() const {
+        return _last_used;
+    }
+
+    double idleSeconds(Clock::time_point now) const {
+        return std::chrono::duration<double>(now - _last_used).count();
+    }
+
+    // Encodes the pixels on the worker. The caller must not write to the
+    // buffer without going through getPixel until finishPack is called.
+    void startPack(Worker &worker) {
+        if (!_pixels || _packing.valid() || _dirty.any() || _load_failed) {
+            return;
+        }
+        getInkBounds();
+        auto pixels = _pixels;
+        int pitch = getPitch();
+        TileGrid grid = _dirty;
+        _packing_generation = _generation;
+        _packing = worker.submit([pixels, pitch, grid] {
+            return packPixels(pixels, pitch, grid);
+        });
+    }
+
+    // Swaps the raw pixels for the packed ones once the worker is done,
+    // unless the buffer was written to in the meantime. Returns true if
+    // the buffer is packed now.
+    bool finishPack(bool wait=false) {
+        if (!_packing.valid()) {
+            return false;
+        }
+        if (!wait && _packing.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return false;
+        }
+        auto packed = _packing.get();
+        _loading = nullptr;
+        // a load that was cancelled before it started, the tiles stay on disk
+        if (_spilled && packed.empty()) {
+            return false;
+        }
+        if (_generation != _packing_generation) {
+            return false;
+        }
+        delete[] _pixels;
+        _pixels = nullptr;
+        _packed = std::move(packed);
+        _spilled = false;
+        _spill_kept.clear();
+        dropTexture();
+        return true;
+    }
+
+    // Writes the packed tiles to file on the worker, they're freed once
+    // that's done. Blank buffers and mapped tiles aren't worth it.
+    void startSpill(Worker &worker, SpillFile &file) {
+        if (_pixels || _spilled || !_packed.owned() || _packing.valid() || _spilling.valid() || !file.ok()) {
+            return;
+        }
+        if (_spill_file && _spill_file != &file) {
+            _spill_file->release(_slot);
+            _slot = SpillFile::Slot{};
+        }
+        // held elsewhere if there are more references than this frame's
+        std::unordered_map<const PackedTile*, long> refs;
+        for (auto &tile : _packed.tiles) {
+            refs[tile.get()] += tile != nullptr;
+        }
+        auto shared = std::make_shared<SharedTiles>();
+        _spilling_kept.clear();
+        for (auto &tile : _packed.tiles) {
+            if (tile && (tile->mapped || tile.use_count() > refs[tile.get()]) && !shared->count(tile.get())) {
+                (*shared)[tile.get()] = _spilling_kept.size();
+                _spilling_kept.push_back(tile);
+            }
+        }
+        auto size = frameBlobSize(_packed, shared.get());
+        if (size == 8 + 4 * _packed.tiles.size()) {
+            _spilling_kept.clear();
+            return;
+        }
+        _spill_file = &file;
+        _slot = file.allocate(size, _slot);
+        auto packed = _packed;
+        auto slot = _slot;
+        auto f = &file;
+        _spilling = worker.submit([f, slot, packed, shared] {
+            return f->write(slot, packed, shared.get());
+        });
+    }
+
+    // returns true if the tiles are on disk only now
+    bool finishSpill(bool wait=false) {
+        if (!_spilling.valid()) {
+            return false;
+        }
+        if (!wait && _spilling.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return false;
+        }
+        if (!_spilling.get() || _pixels) {
+            _spilling_kept.clear();
+            return false;
+        }
+        _packed = PackedFrame{};
+        _spill_kept.swap(_spilling_kept);
+        _spilling_kept.clear();
+        _spilled = true;
+        return true;
+    }
+
+    // Reads spilled tiles back on the worker ahead of other work,
+    // finishPack picks them up
+    void startLoad(Worker &worker) {
+        if (!_spilled || _packing.valid()) {
+            return;
+        }
+        use();
+        auto f = _spill_file;
+        auto slot = _slot;
+        auto kept = _spill_kept;
+        _packing_generation = _generation;
+        _loading = Worker::cancelToken();
+        _packing = worker.submit([f, slot, kept] {
+            // a failed read looks like a cancelled load, the next use
+            // reads again and reports it
+            PackedFrame res;
+            return f->read(slot, res, &kept) ? res : PackedFrame{};
+        }, Worker::INTERACTIVE, _loading);
+    }
+
+    // drops a load that hasn't started yet
+    void cancelLoad() {
+        if (_loading) {
+            _loading->cancel();
+        }
+    }
+
+    bool isLoading() const {
+        return _loading != nullptr;
+    }
+
+    // Decodes the packed tiles on the worker ahead of other work, the
+    // next view() takes them instead of decoding them itself
+    void startDecode(Worker &worker) {
+        if (_pixels || _spilled || _packing.valid() || _decoding.valid()) {
+            return;
+        }
+        use();
+        auto packed = _packed;
+        TileGrid grid = _dirty;
+        int pitch = getPitch();
+        size_t size = 4ull * _dimx * _dimy;
+        _decoding_generation = _generation;
+        _decode_cancel = Worker::cancelToken();
+        _decoding = worker.submit([packed, grid, pitch, size] {
+            std::vector<Uint8> res(size);
+            unpackPixels(packed, res.data(), pitch, grid);
+            return res;
+        }, Worker::INTERACTIVE, _decode_cancel);
+    }
+
+    // drops a decode that hasn't started yet, and what a done one decoded
+    void cancelDecode() {
+        if (_decode_cancel) {
+            _decode_cancel->cancel();
+        }
+        _decoding = std::future<std::vector<Uint8>>();
+        _decode_cancel = nullptr;
+    }
+
+    bool isDecoding() const {
+        return _decoding.valid();
+    }
+
+    bool isDecoded() const {
+        return _decoding.valid() && _decoding.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    // uploads the pixels now if the buffer has no texture or dirty tiles,
+    // so drawing it won't
+    void prepareTexture() {
+        update();
+    }
+
+    void dropTexture() {
+        if (_texture && !_pixels) {
+            SDL_DestroyTexture(_texture);
+            _texture = nullptr;
+        }
+    }
+
+    int getPitch() const {
+        return 4 * _dimx;
+    }
+
+    const TileGrid &getGrid() const {
+        return _dirty;
+    }
+
+    // Pixels for reading, without unpacking the buffer for good. Packed
+    // buffers are decoded into scratch memory that's reused by the next
+    // call.
+    const Uint8 *view() {
+        if (_packing.valid()) {
+            finishPack(true);
+        }
+        if (_pixels) {
+            return _pixels;
+        }
+        static std::vector<Uint8> scratch;
+        if (_takeDecoded(scratch)) {
+            return scratch.data();
+        }
+        _ensureLoaded();
+        scratch.resize(4ull * _dimx * _dimy);
+        unpackPixels(_packed, scratch.data(), getPitch(), _dirty);
+        return scratch.data();
+    }
+
+    // the pixels as tiles, encoded now if the buffer isn't packed
+    PackedFrame getPacked() {
+        if (_packing.valid()) {
+            finishPack(true);
+        }
+        if (_pixels) {
+            return packPixels(_pixels, getPitch(), _dirty);
+        }
+        if (_spilled) {
+            PackedFrame res;
+            _readSpilled(res);
+            return res;
+        }
+        return _packed;
+    }
+
+    // getPacked() for any thread later: raw pixels are copied now and
+    // only encoded when it's called
+    std::function<PackedFrame()> deferPacked() {
+        if (_packing.valid()) {
+            finishPack(true);
+        }
+        if (_pixels) {
+            auto pixels = std::make_shared<std::vector<Uint8>>(_pixels, _pixels + getRawBytes());
+            int pitch = getPitch();
+            TileGrid grid = _dirty;
+            return [pixels, pitch, grid] {
+                return packPixels(pixels->data(), pitch, grid);
+            };
+        }
+        auto packed = getPacked();
+        return [packed] {
+            return packed;
+        };
+    }
+
+    // replaces the pixels, ink is the bounding box of the new ones
+    void setPacked(const PackedFrame &packed, const Bounds &ink) {
+        if (_packing.valid()) {
+            _packing.wait();
+            _packing = std::future<PackedFrame>();
+            _loading = nullptr;
+        }
+        if (_spilling.valid()) {
+            _spilling.get();
+            _spilling_kept.clear();
+        }
+        delete[] _pixels;
+        _pixels = nullptr;
+        _packed = packed;
+        _spilled = false;
+        _spill_kept.clear();
+        _load_failed = false;
+        ++_generation;
+        _dirty.clear();
+        _unsaved.clear();
+        _ink.set(ink);
+        dropTexture();
+    }
+
+    // Replaces the tiles of cell cx, cy with cell, which is on a grid of
+    // its own. Packed buffers stay packed. ink is the bounding box of the
+    // new tiles, in buffer coordinates.
+    void putCell(int cx, int cy, const PackedFrame &cell, const Bounds &ink) {
+        if (_packing.valid()) {
+            finishPack(true);
+        }
+        int w = _dirty.getCellTilesX(), h = _dirty.getCellTilesY();
+        auto first = _dirty.tileRect(cx * w, cy * h), last = _dirty.tileRect(cx * w + w - 1, cy * h + h - 1);
+        Bounds area{first.x, first.y, last.x + last.w - 1, last.y + last.h - 1};
+        if (_pixels) {
+            PackedFrame packed;
+            setCellTiles(packed, _dirty, cx, cy, cell);
+            auto rect = area.rect();
+            unpackPixels(packed, _pixels, getPitch(), _dirty, &rect);
+            markDirty(area);
+            _ink.erase(area);
+        } else {
+            if (_spilling.valid()) {
+                _spilling.get();
+                _spilling_kept.clear();
+            }
+            _ensureLoaded();
+            // rescanning the ink of a packed buffer means unpacking it
+            if (cellTiles(_packed, _dirty, cx, cy).bytes) {
+                _ink.erase(area);
+            }
+            setCellTiles(_packed, _dirty, cx, cy, cell);
+            _unsaved.mark(area);
+            ++_generation;
+            dropTexture();
+        }
+        _ink.draw(ink);
+    }
+
+    // writes one encoded tile, size 0 is a blank one
+    void putTile(int tx, int ty, const Uint8 *data, size_t size) {
+        auto r = _dirty.tileRect(tx, ty);
+        PackedTile tile;
+        tile.data = data;
+        tile.size = size;
+        decodeTile(size ? &tile : nullptr, getPixel(r.x, r.y), getPitch(), r.w, r.h);
+        touch(r.x, r.y, r.x + r.w - 1, r.y + r.h - 1, size);
+    }
+
+    const TileMask &getUnsaved() const {
+        return _unsaved;
+    }
+
+    void markUnsaved(int tx, int ty) {
+        _unsaved.mark(tx, ty);
+    }
+
+    // calls fn(tx, ty, data, size) with every tile written since the last
+    // call, encoded
+    template<typename F>
+    void takeUnsaved(F fn) {
+        // lost tiles would be journaled as blank ones
+        if (!_unsaved.any() || _load_failed) {
+            return;
+        }
+        if (_packing.valid()) {
+            finishPack(true);
+        }
+        PackedFrame packed;
+        if (!_pixels) {
+            packed = getPacked();
+        }
+        std::vector<Uint8> data;
+        _unsaved.forEachTile([&](int tx, int ty) {
+            if (_pixels) {
+                auto r = _dirty.tileRect(tx, ty);
+                encodeTile(_pixels + r.y * getPitch() + 4 * r.x, getPitch(), r.w, r.h, data);
+                fn(tx, ty, data.data(), data.size());
+                return;
+            }
+            auto tile = packed.empty() ? nullptr : packed.tiles[tx + ty * packed.tilesx].get();
+            fn(tx, ty, tile ? tile->data : nullptr, tile ? tile->size : 0);
+        });
+        _unsaved.clear();
+    }
+
+    // called by brushes after they've written the (inclusive) area
+    void touch(int x0, int y0, int x1, int y1, bool ink) {
+        auto b = Bounds{x0, y0, x1, y1}.clipped(_dimx, _dimy);
+        markDirty(b);
+        if (ink) {
+            _ink.draw(b);
+        } else {
+            _ink.erase(b);
+        }
+    }
+
+    const Bounds &getInkBounds() {
+        if (_ink.stale()) {
+            _ensurePixels();
+        }
+        return _ink.get(_pixels, getPitch());
+    }
+
     void tint(int r, int g, int b) {
-        SDL_SetTextureColorMod(_texture, r, g, b);
+        _ensureTexture();
+        if (_texture) {
+            SDL_SetTextureColorMod(_texture, r, g, b);
+        }
+    }
+
+    void markDirty(const Bounds &b) {
+        _dirty.mark(b);
+        _unsaved.mark(b);
+        ++_generation;
+    }
+
+    // puts back a rect taken with takeDirty whose upload was put off,
+    // nothing was written so it's neither unsaved nor a new generation
+    void deferUpload(const SDL_Rect &rect) {
+        _dirty.mark(Bounds{rect.x, rect.y, rect.x + rect.w - 1, rect.y + rect.h - 1});
+    }
+
+    // the whole buffer was rewritten behind our back
+    void invalidate() {
+        _ensurePixels();
+        ++_generation;
+        _dirty.markAll();
+        _unsaved.markAll();
+        _ink.rescan(_dimx, _dimy);
+    }
+
+    // true if tiles were written that the texture doesn't hold yet
+    bool isDirty() const {
+        return _dirty.any();
     }
 
-    void update() {
-        SDL_UpdateTexture(_texture, NULL, _pixels, 4 * _dimx * sizeof (Uint8));
+    // calls fn with rects covering everything written since the last call
+    template<typename F>
+    void takeDirty(F fn) {
+        _dirty.forEachSpan(fn);
+        _dirty.clear();
+    }
+
+    // Returns false if all upload buffers were busy and the upload was put
+    // off, the tiles stay dirty until the next call.
+    bool update(UploadRing *ring=nullptr) {
+        if (!_renderer) {
+            _dirty.clear();
+            return true;
+        }
+        _ensureTexture();
+        if (ring && _upload == STATIC && !_pbo_failed && !ring->failed() && _dirty.any()) {
+            if (_updateStaged(*ring)) {
+                _dirty.clear();
+                return true;
+            }
+            // busy buffers are waited out, a failed ring isn't
+            if (!_pbo_failed && !ring->failed()) {
+                return false;
+            }
+        }
+        takeDirty([this](const SDL_Rect &rect) {
+            auto src = getPixel(rect.x, rect.y);
+            if (_upload == STATIC) {
+                SDL_UpdateTexture(_texture, &rect, src, getPitch());
+                return;
+            }
+            void *dst;
+            int pitch;
+            if (SDL_LockTexture(_texture, &rect, &dst, &pitch) < 0) {
+                return;
+            }
+            for (int y = 0; y < rect.h; ++y) {
+                memcpy((Uint8*)dst + y * pitch, src + y * getPitch(), 4 * rect.w);
+            }
+            SDL_UnlockTexture(_texture);
+        });
+        return true;
     }
 
     void render(SDL_Rect *src, SDL_Rect *dest) {
-        SDL_RenderCopy(_renderer, _texture, src, dest);
+        _ensureTexture();
+        if (_texture) {
+            SDL_RenderCopy(_renderer, _texture, src, dest);
+        }
+    }
+
+    // ink is in screen coordinates, the whole buffer's ink if not given
+    Layer getLayer(int offx=0, int offy=0, int r=255, int g=255, int b=255, const SDL_Rect *ink=nullptr) {
+        _ensureTexture();
+        SDL_Rect rect{0, 0, 0, 0};
+        if (ink) {
+            rect = *ink;
+        } else if (!getInkBounds().empty()) {
+            rect = getInkBounds().rect();
+        }
+        return Layer{_texture, 0, 0, offx, offy, _dimx, _dimy, r/255.f, g/255.f, b/255.f, rect};
+    }
+
+    void renderInk() {
+        auto &b = getInkBounds();
+        if (b.empty()) {
+            return;
+        }
+        auto rect = b.rect();
+        render(&rect, &rect);
     }
 };
 
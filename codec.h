@@ -0,0 +1,472 @@
+#ifndef _CODEC_H
+#define _CODEC_H
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+#include "tiles.h"
+
+
+// Run-length coding of one tile of ARGB pixels, read row by row as a
+// single run of w*h pixels. Line art is mostly zero with runs of the ink
+// color, so there are three kinds of tokens:
+//   0x00-0x7f  1-128 zero pixels
+//   0x80-0xbf  1-64 copies of the pixel that follows
+//   0xc0-0xff  1-64 literal pixels follow
+// An all-zero tile encodes to nothing.
+
+struct PackedTile {
+    const Uint8 *data = nullptr;
+    size_t size = 0;
+    // owns data, unless it points into a blob kept alive by keep
+    std::vector<Uint8> storage;
+    std::shared_ptr<const void> keep;
+    // the blob is a mapped file
+    bool mapped = false;
+};
+
+// nullptr is a blank tile
+typedef std::shared_ptr<const PackedTile> TileRef;
+
+TileRef makeTile(const std::vector<Uint8> &data) {
+    auto tile = std::make_shared<PackedTile>();
+    tile->storage = data;
+    tile->data = tile->storage.data();
+    tile->size = data.size();
+    return tile;
+}
+
+Uint64 hashBytes(const Uint8 *data, size_t size) {
+    const Uint64 k = 0xff51afd7ed558ccdull;
+    Uint64 h = 0x9e3779b97f4a7c15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        Uint64 w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 32;
+    }
+    Uint64 w = 0;
+    memcpy(&w, data + i, size - i);
+    h = (h ^ w) * k;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ h >> 33;
+}
+
+// Every distinct tile alive is kept once: tiles with the same content
+// are shared by all frames that have them, held frames and copies cost
+// no more than their pointers. Used from the worker as well.
+class TileCache {
+    std::mutex _mutex;
+    std::unordered_map<Uint64, std::weak_ptr<const PackedTile>> _tiles;
+    size_t _prune_at = 4096;
+
+public:
+    static TileCache &get() {
+        static TileCache cache;
+        return cache;
+    }
+
+    // tile, or the one alive with the same content
+    TileRef intern(TileRef tile) {
+        if (!tile) {
+            return tile;
+        }
+        auto hash = hashBytes(tile->data, tile->size);
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &entry = _tiles[hash];
+        auto known = entry.lock();
+        if (known && known->size == tile->size && !memcmp(known->data, tile->data, tile->size)) {
+            return known;
+        }
+        // a collision just isn't shared
+        if (!known) {
+            entry = tile;
+        }
+        if (_tiles.size() >= _prune_at) {
+            for (auto it = _tiles.begin(); it != _tiles.end(); ) {
+                it = it->second.expired() ? _tiles.erase(it) : std::next(it);
+            }
+            _prune_at = std::max<size_t>(4096, 2 * _tiles.size());
+        }
+        return tile;
+    }
+};
+
+void encodeTile(const Uint8 *src, int pitch, int w, int h, std::vector<Uint8> &out) {
+    Uint32 px[TILE_SIZE * TILE_SIZE];
+    int n = w * h;
+    bool blank = true;
+    for (int y = 0; y < h; ++y) {
+        memcpy(px + y * w, src + y * pitch, 4 * w);
+    }
+    for (int i = 0; i < n && blank; ++i) {
+        blank = !px[i];
+    }
+    out.clear();
+    if (blank) {
+        return;
+    }
+
+    auto put = [&out](Uint32 p) {
+        Uint8 bytes[4];
+        memcpy(bytes, &p, 4);
+        out.insert(out.end(), bytes, bytes + 4);
+    };
+    int i = 0;
+    while (i < n) {
+        int run = 1;
+        while (i + run < n && px[i + run] == px[i]) {
+            ++run;
+        }
+        if (!px[i]) {
+            run = std::min(run, 128);
+            out.push_back(run - 1);
+        } else if (run >= 2) {
+            run = std::min(run, 64);
+            out.push_back(0x80 + run - 1);
+            put(px[i]);
+        } else {
+            // literals until the next run of two
+            int len = 1;
+            while (i + len < n && len < 64 &&
+                    px[i + len] && !(i + len + 1 < n && px[i + len + 1] == px[i + len])) {
+                ++len;
+            }
+            out.push_back(0xc0 + len - 1);
+            for (int j = 0; j < len; ++j) {
+                put(px[i + j]);
+            }
+            run = len;
+        }
+        i += run;
+    }
+}
+
+// tile may be nullptr (blank). Returns false if the tile is cut short,
+// the pixels past where it ends are blank.
+bool decodeTile(const PackedTile *tile, Uint8 *dst, int pitch, int w, int h) {
+    if (!tile) {
+        for (int y = 0; y < h; ++y) {
+            memset(dst + y * pitch, 0, 4 * w);
+        }
+        return true;
+    }
+    Uint32 px[TILE_SIZE * TILE_SIZE];
+    int n = w * h, i = 0;
+    auto data = tile->data, end = data + tile->size;
+    bool ok = true;
+    while (data < end && i < n) {
+        int c = *data++;
+        if (c < 0x80) {
+            int run = std::min(c + 1, n - i);
+            memset(px + i, 0, 4 * run);
+            i += run;
+        } else if (c < 0xc0) {
+            if (end - data < 4) {
+                ok = false;
+                break;
+            }
+            Uint32 p;
+            memcpy(&p, data, 4);
+            data += 4;
+            int run = std::min(c - 0x80 + 1, n - i);
+            std::fill(px + i, px + i + run, p);
+            i += run;
+        } else {
+            int len = std::min(c - 0xc0 + 1, n - i);
+            if (end - data < 4 * len) {
+                ok = false;
+                break;
+            }
+            memcpy(px + i, data, 4 * len);
+            data += 4 * len;
+            i += len;
+        }
+    }
+    if (i < n) {
+        memset(px + i, 0, 4 * (n - i));
+    }
+    for (int y = 0; y < h; ++y) {
+        memcpy(dst + y * pitch, px + y * w, 4 * w);
+    }
+    return ok;
+}
+
+// Encodes the pixelwise XOR of two w x h tiles, either may be nullptr
+// (blank). The XOR with one of them gives back the other, so this both
+// makes and applies the delta of a tile against a reference.
+void xorTiles(const PackedTile *a, const PackedTile *b, int w, int h, std::vector<Uint8> &out) {
+    Uint32 pa[TILE_SIZE * TILE_SIZE], pb[TILE_SIZE * TILE_SIZE];
+    decodeTile(a, (Uint8*)pa, 4 * w, w, h);
+    decodeTile(b, (Uint8*)pb, 4 * w, w, h);
+    for (int i = 0; i < w * h; ++i) {
+        pb[i] ^= pa[i];
+    }
+    encodeTile((const Uint8*)pb, 4 * w, w, h, out);
+}
+
+// Memory tiles account for, each split between everything holding it so
+// that a tile shared by frames adds up to its size once. Mapped tiles
+// cost nothing.
+size_t chargedBytes(const std::vector<TileRef> &tiles) {
+    size_t res = 0;
+    for (auto &tile : tiles) {
+        if (tile && !tile->mapped) {
+            res += tile->size / std::max<long>(1, tile.use_count());
+        }
+    }
+    return res;
+}
+
+// A whole Buffer as encoded tiles on its TileGrid, no tiles at all is a
+// blank buffer
+struct PackedFrame {
+    int tilesx = 0, tilesy = 0;
+    std::vector<TileRef> tiles;
+    size_t bytes = 0;
+    // of those, bytes that live in a mapped file and cost no memory of ours
+    size_t mapped = 0;
+
+    bool empty() const {
+        return tiles.empty();
+    }
+
+    size_t owned() const {
+        return bytes - mapped;
+    }
+
+    // this frame's part of the memory its tiles take, see chargedBytes
+    size_t charged() const {
+        return chargedBytes(tiles);
+    }
+};
+
+PackedFrame packPixels(const Uint8 *pixels, int pitch, const TileGrid &grid) {
+    PackedFrame res;
+    res.tilesx = grid.getTilesX();
+    res.tilesy = grid.getTilesY();
+    res.tiles.resize(res.tilesx * res.tilesy);
+    std::vector<Uint8> data;
+    for (int ty = 0; ty < res.tilesy; ++ty) {
+        for (int tx = 0; tx < res.tilesx; ++tx) {
+            auto rect = grid.tileRect(tx, ty);
+            encodeTile(pixels + rect.y * pitch + 4 * rect.x, pitch, rect.w, rect.h, data);
+            if (data.empty()) {
+                continue;
+            }
+            res.bytes += data.size();
+            res.tiles[tx + ty * res.tilesx] = TileCache::get().intern(makeTile(data));
+        }
+    }
+    return res;
+}
+
+// decodes the tiles overlapping rect (in pixels) into pixels, false if
+// one of them was corrupt
+bool unpackPixels(const PackedFrame &packed, Uint8 *pixels, int pitch, const TileGrid &grid,
+                  const SDL_Rect *rect=nullptr) {
+    SDL_Rect all{0, 0, grid.getDimX(), grid.getDimY()};
+    if (!rect) {
+        rect = &all;
+    }
+    if (rect->w <= 0 || rect->h <= 0) {
+        return true;
+    }
+    bool ok = true;
+    for (int ty = grid.tileY(rect->y); ty <= grid.tileY(rect->y + rect->h - 1); ++ty) {
+        for (int tx = grid.tileX(rect->x); tx <= grid.tileX(rect->x + rect->w - 1); ++tx) {
+            auto r = grid.tileRect(tx, ty);
+            ok = decodeTile(packed.empty() ? nullptr : packed.tiles[tx + ty * packed.tilesx].get(),
+                            pixels + r.y * pitch + 4 * r.x, pitch, r.w, r.h) && ok;
+        }
+    }
+    return ok;
+}
+
+// tiles of one cell (frame) of grid, as a PackedFrame of its own
+PackedFrame cellTiles(const PackedFrame &packed, const TileGrid &grid, int cx, int cy) {
+    PackedFrame res;
+    res.tilesx = grid.getCellTilesX();
+    res.tilesy = grid.getCellTilesY();
+    if (packed.empty()) {
+        return res;
+    }
+    res.tiles.resize(res.tilesx * res.tilesy);
+    for (int ty = 0; ty < res.tilesy; ++ty) {
+        for (int tx = 0; tx < res.tilesx; ++tx) {
+            auto &tile = packed.tiles[cx * res.tilesx + tx + (cy * res.tilesy + ty) * packed.tilesx];
+            if (tile) {
+                res.bytes += tile->size;
+                res.mapped += tile->mapped ? tile->size : 0;
+                res.tiles[tx + ty * res.tilesx] = tile;
+            }
+        }
+    }
+    return res;
+}
+
+// Puts the tiles of a cell into packed, which covers all of grid. False
+// if cell isn't on the grid of a cell, nothing is replaced then.
+bool setCellTiles(PackedFrame &packed, const TileGrid &grid, int cx, int cy, const PackedFrame &cell) {
+    int w = grid.getCellTilesX(), h = grid.getCellTilesY();
+    if (!cell.empty() && (cell.tilesx != w || cell.tilesy != h || (int)cell.tiles.size() != w * h)) {
+        return false;
+    }
+    if (packed.empty()) {
+        packed.tilesx = grid.getTilesX();
+        packed.tilesy = grid.getTilesY();
+        packed.tiles.resize(packed.tilesx * packed.tilesy);
+    }
+    for (int ty = 0; ty < h; ++ty) {
+        for (int tx = 0; tx < w; ++tx) {
+            auto &dst = packed.tiles[cx * w + tx + (cy * h + ty) * packed.tilesx];
+            if (dst) {
+                packed.bytes -= dst->size;
+                packed.mapped -= dst->mapped ? dst->size : 0;
+            }
+            dst = cell.empty() ? nullptr : cell.tiles[tx + ty * w];
+            if (dst) {
+                packed.bytes += dst->size;
+                packed.mapped += dst->mapped ? dst->size : 0;
+            }
+        }
+    }
+    return true;
+}
+
+// A PackedFrame as stored in files: tilesx, tilesy, the size of every
+// tile and then the tiles back to back. A size with FRAME_BLOB_SHARED set
+// is the index of a tile stored once for the whole file instead, one
+// with FRAME_BLOB_DELTA set a tile stored as its xorTiles delta against
+// the tile of a keyframe.
+#define FRAME_BLOB_SHARED 0x80000000u
+#define FRAME_BLOB_DELTA 0x40000000u
+
+typedef std::unordered_map<const PackedTile*, Uint32> SharedTiles;
+
+size_t frameBlobSize(const PackedFrame &packed, const SharedTiles *shared=nullptr) {
+    size_t res = 8 + 4 * packed.tiles.size() + packed.bytes;
+    for (auto &tile : packed.tiles) {
+        if (shared && tile && shared->count(tile.get())) {
+            res -= tile->size;
+        }
+    }
+    return res;
+}
+
+// shared maps tiles written elsewhere to their index, delta marks the
+// tiles that are deltas
+void writeFrameBlob(const PackedFrame &packed, std::vector<Uint8> &out, const SharedTiles *shared=nullptr,
+                    const std::vector<bool> *delta=nullptr) {
+    auto put = [&out](Uint32 v) {
+        Uint8 bytes[4];
+        memcpy(bytes, &v, 4);
+        out.insert(out.end(), bytes, bytes + 4);
+    };
+    // blank frames have no tiles to give sizes for
+    put(packed.empty() ? 0 : packed.tilesx);
+    put(packed.empty() ? 0 : packed.tilesy);
+    auto sharedIndex = [shared](const TileRef &tile) -> Sint64 {
+        if (!shared || !tile) {
+            return -1;
+        }
+        auto it = shared->find(tile.get());
+        return it == shared->end() ? -1 : (Sint64)it->second;
+    };
+    for (size_t t = 0; t < packed.tiles.size(); ++t) {
+        auto &tile = packed.tiles[t];
+        auto i = sharedIndex(tile);
+        bool is_delta = delta && (*delta)[t];
+        put(i >= 0 ? FRAME_BLOB_SHARED | i : tile ? tile->size | (is_delta ? FRAME_BLOB_DELTA : 0) : 0);
+    }
+    for (auto &tile : packed.tiles) {
+        if (tile && sharedIndex(tile) < 0) {
+            out.insert(out.end(), tile->data, tile->data + tile->size);
+        }
+    }
+}
+
+// Tiles point into blob, which keep has to keep alive. mapped says the
+// blob lives in a mapped file, shared are the tiles stored once for it.
+// Delta tiles are left as they are and marked in delta. False if the
+// blob is malformed.
+bool readFrameBlob(const Uint8 *blob, size_t size, std::shared_ptr<const void> keep, bool mapped,
+                   PackedFrame &packed, const std::vector<TileRef> *shared=nullptr,
+                   std::vector<bool> *delta=nullptr) {
+    packed = PackedFrame{};
+    if (delta) {
+        delta->clear();
+    }
+    auto get = [blob](size_t pos) {
+        Uint32 v;
+        memcpy(&v, blob + pos, 4);
+        return v;
+    };
+    if (size < 8) {
+        return false;
+    }
+    // every tile takes 4 bytes of the table at least
+    Uint32 tilesx = get(0), tilesy = get(4);
+    size_t max_tiles = (size - 8) / 4;
+    if ((tilesx && tilesy > max_tiles / tilesx) || tilesx > INT_MAX || tilesy > INT_MAX) {
+        return false;
+    }
+    packed.tilesx = tilesx;
+    packed.tilesy = tilesy;
+    size_t n = (size_t)tilesx * tilesy, pos = 8 + 4 * n;
+    if (!n) {
+        return true;
+    }
+    packed.tiles.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        size_t tile_size = get(8 + 4 * i);
+        if (!tile_size) {
+            continue;
+        }
+        if (tile_size & FRAME_BLOB_SHARED) {
+            size_t index = tile_size & ~FRAME_BLOB_SHARED;
+            if (!shared || index >= shared->size()) {
+                packed = PackedFrame{};
+                return false;
+            }
+            auto &tile = (*shared)[index];
+            packed.tiles[i] = tile;
+            packed.bytes += tile->size;
+            packed.mapped += tile->mapped ? tile->size : 0;
+            continue;
+        }
+        bool is_delta = tile_size & FRAME_BLOB_DELTA;
+        tile_size &= ~FRAME_BLOB_DELTA;
+        if (tile_size > size - pos || (is_delta && !delta)) {
+            packed = PackedFrame{};
+            return false;
+        }
+        auto tile = std::make_shared<PackedTile>();
+        tile->data = blob + pos;
+        tile->size = tile_size;
+        tile->keep = keep;
+        tile->mapped = mapped;
+        if (is_delta) {
+            delta->resize(n);
+            (*delta)[i] = true;
+            packed.tiles[i] = tile;
+        } else {
+            packed.tiles[i] = TileCache::get().intern(tile);
+        }
+        packed.bytes += tile_size;
+        packed.mapped += packed.tiles[i]->mapped ? tile_size : 0;
+        pos += tile_size;
+    }
+    return true;
+}
+
+#endif
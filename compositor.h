@@ -0,0 +1,296 @@
+#ifndef _COMPOSITOR_H
+#define _COMPOSITOR_H
+
+#include <cstdio>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <GL/glew.h>
+
+
+// One texture to be added into the final image: the region of the texture
+// starting at (offx, offy) is mapped onto the screen starting at (0, 0),
+// same as SDL_BLENDMODE_ADD with a color mod. The texture is either an
+// SDL texture or a layer of a GL_TEXTURE_2D_ARRAY. Only the ink rect (in
+// screen coordinates) is sampled, the rest of the texture may have never
+// been uploaded.
+struct Layer {
+    SDL_Texture *texture;
+    GLuint array;
+    int layer;
+    int offx, offy;
+    int texw, texh;
+    float r, g, b;
+    SDL_Rect ink;
+};
+
+// Composites the background, the onion skins and the current frame in a
+// single fragment pass instead of one SDL_RenderCopy per layer. Runs on
+// the GL context of the SDL renderer; draw() returns false and the caller
+// falls back if the shader can't be built.
+class Compositor {
+    const static int MAX_LAYERS = 6;
+
+    struct Program {
+        GLuint id = 0;
+        bool failed = false;
+        GLint u_background, u_tex, u_layer, u_offset, u_scale, u_tint, u_ink, u_height, u_flip;
+    };
+
+    // every layer is an SDL texture
+    Program _flat;
+    // the background is an SDL texture, frames are texture array layers
+    Program _array;
+
+    const char *_vertex_src =
+        "void main() {\n"
+        "    gl_Position = gl_Vertex;\n"
+        "}\n";
+
+    // GLSL 1.20 and 1.30 only index sampler arrays with constant
+    // expressions, a loop index isn't one, so every layer is sampled on a
+    // line of its own
+    const char *_flat_src =
+        "uniform sampler2D u_tex[6];\n"
+        "uniform vec2 u_offset[6];\n"
+        "uniform vec2 u_scale[6];\n"
+        "uniform vec3 u_tint[6];\n"
+        "uniform vec4 u_ink[6];\n"
+        "uniform float u_height;\n"
+        "uniform float u_flip;\n"
+        "float inside(vec2 p, vec4 r) {\n"
+        "    return step(r.x, p.x) * step(r.y, p.y) * step(p.x, r.z) * step(p.y, r.w);\n"
+        "}\n"
+        "vec3 layer(sampler2D tex, int i, vec2 p) {\n"
+        "    vec4 c = texture2D(tex, (p + u_offset[i]) * u_scale[i]);\n"
+        "    return c.rgb * c.a * u_tint[i] * inside(p, u_ink[i]);\n"
+        "}\n"
+        "void main() {\n"
+        "    vec2 p = vec2(gl_FragCoord.x, mix(gl_FragCoord.y, u_height - gl_FragCoord.y, u_flip));\n"
+        "    vec3 sum = layer(u_tex[0], 0, p);\n"
+        "    sum += layer(u_tex[1], 1, p);\n"
+        "    sum += layer(u_tex[2], 2, p);\n"
+        "    sum += layer(u_tex[3], 3, p);\n"
+        "    sum += layer(u_tex[4], 4, p);\n"
+        "    sum += layer(u_tex[5], 5, p);\n"
+        "    gl_FragColor = vec4(min(sum, vec3(1.0)), 1.0);\n"
+        "}\n";
+
+    const char *_array_src =
+        "uniform sampler2D u_background;\n"
+        "uniform sampler2DArray u_tex[5];\n"
+        "uniform float u_layer[5];\n"
+        "uniform vec2 u_offset[6];\n"
+        "uniform vec2 u_scale[6];\n"
+        "uniform vec3 u_tint[6];\n"
+        "uniform vec4 u_ink[6];\n"
+        "uniform float u_height;\n"
+        "uniform float u_flip;\n"
+        "float inside(vec2 p, vec4 r) {\n"
+        "    return step(r.x, p.x) * step(r.y, p.y) * step(p.x, r.z) * step(p.y, r.w);\n"
+        "}\n"
+        "vec3 frame(sampler2DArray tex, float layer, int i, vec2 p) {\n"
+        "    vec4 c = texture(tex, vec3((p + u_offset[i]) * u_scale[i], layer));\n"
+        "    return c.rgb * c.a * u_tint[i] * inside(p, u_ink[i]);\n"
+        "}\n"
+        "void main() {\n"
+        "    vec2 p = vec2(gl_FragCoord.x, mix(gl_FragCoord.y, u_height - gl_FragCoord.y, u_flip));\n"
+        "    vec4 c = texture(u_background, (p + u_offset[0]) * u_scale[0]);\n"
+        "    vec3 sum = c.rgb * c.a * u_tint[0] * inside(p, u_ink[0]);\n"
+        "    sum += frame(u_tex[0], u_layer[0], 1, p);\n"
+        "    sum += frame(u_tex[1], u_layer[1], 2, p);\n"
+        "    sum += frame(u_tex[2], u_layer[2], 3, p);\n"
+        "    sum += frame(u_tex[3], u_layer[3], 4, p);\n"
+        "    sum += frame(u_tex[4], u_layer[4], 5, p);\n"
+        "    gl_FragColor = vec4(min(sum, vec3(1.0)), 1.0);\n"
+        "}\n";
+
+    GLuint _compile(GLenum type, const char *version, const char *src) {
+        GLuint shader = glCreateShader(type);
+        const char *srcs[] = {version, src};
+        glShaderSource(shader, 2, srcs, nullptr);
+        glCompileShader(shader);
+        GLint ok;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        // warnings too, drivers accept things other drivers reject
+        char log[1024] = "";
+        glGetShaderInfoLog(shader, sizeof log, nullptr, log);
+        if (log[0]) {
+            fprintf(stderr, "Compositor shader: %s\n", log);
+        }
+        if (!ok) {
+            glDeleteShader(shader);
+            return 0;
+        }
+        return shader;
+    }
+
+    bool _build(Program &prog, const char *version, const char *fragment_src) {
+        auto vs = _compile(GL_VERTEX_SHADER, version, _vertex_src);
+        auto fs = _compile(GL_FRAGMENT_SHADER, version, fragment_src);
+        if (!vs || !fs) {
+            glDeleteShader(vs);
+            glDeleteShader(fs);
+            return false;
+        }
+        prog.id = glCreateProgram();
+        glAttachShader(prog.id, vs);
+        glAttachShader(prog.id, fs);
+        glLinkProgram(prog.id);
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        GLint ok;
+        glGetProgramiv(prog.id, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            char log[1024] = "";
+            glGetProgramInfoLog(prog.id, sizeof log, nullptr, log);
+            fprintf(stderr, "Compositor program: %s\n", log);
+            glDeleteProgram(prog.id);
+            prog.id = 0;
+            return false;
+        }
+        prog.u_background = glGetUniformLocation(prog.id, "u_background");
+        prog.u_tex = glGetUniformLocation(prog.id, "u_tex");
+        prog.u_layer = glGetUniformLocation(prog.id, "u_layer");
+        prog.u_offset = glGetUniformLocation(prog.id, "u_offset");
+        prog.u_scale = glGetUniformLocation(prog.id, "u_scale");
+        prog.u_tint = glGetUniformLocation(prog.id, "u_tint");
+        prog.u_ink = glGetUniformLocation(prog.id, "u_ink");
+        prog.u_height = glGetUniformLocation(prog.id, "u_height");
+        prog.u_flip = glGetUniformLocation(prog.id, "u_flip");
+        return true;
+    }
+
+    bool _ready(Program &prog, bool arrays) {
+        if (!prog.id && !prog.failed) {
+            if (arrays) {
+                prog.failed = !GLEW_VERSION_3_0 || !_build(prog, "#version 130\n", _array_src);
+            } else {
+                prog.failed = !GLEW_VERSION_2_0 || !_build(prog, "#version 120\n", _flat_src);
+            }
+        }
+        return prog.id;
+    }
+
+    void _drop(Program &prog) {
+        glDeleteProgram(prog.id);
+        prog.id = 0;
+        prog.failed = true;
+    }
+
+public:
+    ~Compositor() {
+        glDeleteProgram(_flat.id);
+        glDeleteProgram(_array.id);
+    }
+
+    bool supportsArrays() {
+        return _ready(_array, true);
+    }
+
+    // Background first, then up to MAX_LAYERS-1 frames that are either all
+    // SDL textures or all array layers; returns false if nothing was drawn
+    // and the caller should fall back. target is true if the renderer
+    // draws into a texture.
+    bool draw(SDL_Renderer *renderer, const std::vector<Layer> &layers, int width, int height, bool target=false) {
+        if (layers.empty() || (int)layers.size() > MAX_LAYERS) {
+            return false;
+        }
+        bool arrays = layers.size() > 1 && layers[1].array;
+        for (size_t i = 1; i < layers.size(); ++i) {
+            if ((bool)layers[i].array != arrays) {
+                return false;
+            }
+        }
+        auto &prog = arrays ? _array : _flat;
+        if (!_ready(prog, arrays)) {
+            return false;
+        }
+        SDL_RenderFlush(renderer);
+
+        GLint last_program, last_active_texture;
+        glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
+        glGetIntegerv(GL_ACTIVE_TEXTURE, &last_active_texture);
+        glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_VIEWPORT_BIT | GL_TEXTURE_BIT);
+        glDisable(GL_BLEND);
+        glDisable(GL_SCISSOR_TEST);
+        glViewport(0, 0, width, height);
+
+        GLint units[MAX_LAYERS];
+        GLfloat layer_idx[MAX_LAYERS], offset[2*MAX_LAYERS], scale[2*MAX_LAYERS], tint[3*MAX_LAYERS];
+        GLfloat ink[4*MAX_LAYERS];
+        bool ok = true;
+        for (int i = 0; i < MAX_LAYERS; ++i) {
+            // unused units sample the last layer with zero weight
+            bool used = i < (int)layers.size();
+            auto &layer = layers[used ? i : layers.size()-1];
+            float sx = 1, sy = 1;
+            glActiveTexture(GL_TEXTURE0 + i);
+            if (layer.array && i > 0) {
+                glBindTexture(GL_TEXTURE_2D_ARRAY, layer.array);
+            } else if (!arrays || i == 0) {
+                SDL_GL_BindTexture(layer.texture, &sx, &sy);
+                GLint bound;
+                glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+                // rectangle textures would need another sampler type
+                ok = ok && bound;
+            }
+            units[i] = i;
+            layer_idx[i] = layer.layer;
+            offset[2*i] = layer.offx;
+            offset[2*i+1] = layer.offy;
+            scale[2*i] = sx / layer.texw;
+            scale[2*i+1] = sy / layer.texh;
+            tint[3*i] = used ? layer.r : 0;
+            tint[3*i+1] = used ? layer.g : 0;
+            tint[3*i+2] = used ? layer.b : 0;
+            ink[4*i] = layer.ink.x;
+            ink[4*i+1] = layer.ink.y;
+            ink[4*i+2] = layer.ink.x + layer.ink.w;
+            ink[4*i+3] = layer.ink.y + layer.ink.h;
+        }
+
+        if (ok) {
+            glUseProgram(prog.id);
+            if (arrays) {
+                glUniform1i(prog.u_background, units[0]);
+                glUniform1iv(prog.u_tex, MAX_LAYERS-1, units+1);
+                glUniform1fv(prog.u_layer, MAX_LAYERS-1, layer_idx+1);
+            } else {
+                glUniform1iv(prog.u_tex, MAX_LAYERS, units);
+            }
+            glUniform2fv(prog.u_offset, MAX_LAYERS, offset);
+            glUniform2fv(prog.u_scale, MAX_LAYERS, scale);
+            glUniform3fv(prog.u_tint, MAX_LAYERS, tint);
+            glUniform4fv(prog.u_ink, MAX_LAYERS, ink);
+            glUniform1f(prog.u_height, height);
+            // render targets are bottom up already
+            glUniform1f(prog.u_flip, target ? 0 : 1);
+            glBegin(GL_TRIANGLE_STRIP);
+            glVertex2f(-1, -1);
+            glVertex2f(1, -1);
+            glVertex2f(-1, 1);
+            glVertex2f(1, 1);
+            glEnd();
+        }
+
+        for (int i = MAX_LAYERS-1; i >= 0; --i) {
+            auto &layer = layers[i < (int)layers.size() ? i : layers.size()-1];
+            glActiveTexture(GL_TEXTURE0 + i);
+            if (layer.array && i > 0) {
+                glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+            } else if (!arrays || i == 0) {
+                SDL_GL_UnbindTexture(layer.texture);
+            }
+        }
+        glActiveTexture(last_active_texture);
+        glUseProgram(last_program);
+        glPopAttrib();
+        if (!ok) {
+            _drop(prog);
+        }
+        return ok;
+    }
+};
+
+#endif
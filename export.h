@@ -0,0 +1,383 @@
+#ifndef _EXPORT_H
+#define _EXPORT_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include "bounds.h"
+#include "codec.h"
+#include "project.h"
+#include "tiles.h"
+#include "worker.h"
+
+
+// What goes into an exported frame, as on screen: the background, up to
+// two onion skins on either side and the frame itself
+struct ExportOptions {
+    bool background = true;
+    bool onion_prev = false;
+    bool onion_next = false;
+    bool onion_colors = true;
+};
+
+// Adds the tiles of a frame within ink into out (BGRA), like the
+// compositor does: color times alpha times tint, saturated
+void addLayer(Uint8 *out, const PackedFrame &tiles, const Bounds &ink, int dimx, int dimy,
+              int r, int g, int b, std::vector<Uint8> &scratch) {
+    auto area = ink.clipped(dimx, dimy);
+    if (tiles.empty() || area.empty()) {
+        return;
+    }
+    scratch.resize(4ull * dimx * dimy);
+    auto rect = area.rect();
+    unpackPixels(tiles, scratch.data(), 4 * dimx, TileGrid(dimx, dimy), &rect);
+    int tint[3] = {b, g, r};
+    for (int y = area.y0; y <= area.y1; ++y) {
+        auto src = &scratch[4ull * (dimx * y + area.x0)];
+        auto dst = out + 4ull * (dimx * y + area.x0);
+        for (int x = area.x0; x <= area.x1; ++x, src += 4, dst += 4) {
+            int a = src[3];
+            if (!a) {
+                continue;
+            }
+            for (int c = 0; c < 3; ++c) {
+                int t = src[c] * a * tint[c];
+                dst[c] = std::min(255, dst[c] + (t + 32512) / 65025);
+            }
+        }
+    }
+}
+
+// frame of the snapshot as shown on screen, BGRA
+void compositeFrame(const ProjectSnapshot &snapshot, int frame, const ExportOptions &opts,
+                    Uint8 *out, std::vector<Uint8> &scratch) {
+    int dimx = snapshot.dimx, dimy = snapshot.dimy;
+    int count = std::max(1, std::min<int>(snapshot.frame_cnt, snapshot.frames.size() - 1));
+    memset(out, 0, 4ull * dimx * dimy);
+    if (opts.background) {
+        addLayer(out, snapshot.frames.back(), snapshot.inks.back(), dimx, dimy, 255, 255, 255, scratch);
+    }
+    auto onion = [&](int delta) {
+        return ((frame + delta) % count + count) % count;
+    };
+    for (int i = 0; i < opts.onion_prev * 2; ++i) {
+        int tint = opts.onion_colors ? 255 - (255 - 63) * i : 255, other = opts.onion_colors ? 0 : 255;
+        int f = onion(-i - 1);
+        addLayer(out, snapshot.frames[f], snapshot.inks[f], dimx, dimy, tint, other, other, scratch);
+    }
+    for (int i = 0; i < opts.onion_next * 2; ++i) {
+        int tint = opts.onion_colors ? 255 - (255 - 63) * i : 255, other = opts.onion_colors ? 0 : 255;
+        int f = onion(i + 1);
+        addLayer(out, snapshot.frames[f], snapshot.inks[f], dimx, dimy, other, tint, other, scratch);
+    }
+    addLayer(out, snapshot.frames[frame], snapshot.inks[frame], dimx, dimy, 255, 255, 255, scratch);
+}
+
+// Full range BT.601 (JPEG) coefficients in Q14, for B, G, R
+#define YUV_SHIFT 14
+static const int YUV_Y[3] = {1868, 9617, 4899};
+static const int YUV_U[3] = {8192, -5427, -2765};
+static const int YUV_V[3] = {-1332, -6860, 8192};
+
+// n BGRA pixels into n samples of coef, plus offset
+void bgraToPlane(const Uint8 *src, Uint8 *dst, int n, const int coef[3], int offset) {
+    int i = 0;
+    int bias = (offset << YUV_SHIFT) + (1 << (YUV_SHIFT - 1));
+#ifdef __SSE2__
+    const __m128i c = _mm_set_epi16(0, coef[2], coef[1], coef[0], 0, coef[2], coef[1], coef[0]);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(bias);
+    for (; i + 4 <= n; i += 4) {
+        auto px = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+        // B*cb + G*cg and R*cr of every pixel
+        auto lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), c));
+        auto hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(px, zero), c));
+        auto sum = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+                                 _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), YUV_SHIFT);
+        auto bytes = _mm_packus_epi16(_mm_packs_epi32(sum, zero), zero);
+        int v = _mm_cvtsi128_si32(bytes);
+        memcpy(dst + i, &v, 4);
+    }
+#endif
+    for (; i < n; ++i) {
+        auto p = src + 4 * i;
+        int v = (p[0] * coef[0] + p[1] * coef[1] + p[2] * coef[2] + bias) >> YUV_SHIFT;
+        dst[i] = std::max(0, std::min(255, v));
+    }
+}
+
+// Averages 2x2 blocks of two BGRA rows into w BGRA pixels, the last
+// column repeats if the rows have an odd number of pixels
+void halveRows(const Uint8 *row0, const Uint8 *row1, Uint8 *dst, int w, int src_w) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; 2 * i + 4 <= src_w; i += 2) {
+        auto v = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + 8 * i)),
+                              _mm_loadu_si128((const __m128i*)(row1 + 8 * i)));
+        v = _mm_avg_epu8(v, _mm_srli_epi64(v, 32));
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storel_epi64((__m128i*)(dst + 4 * i), v);
+    }
+#endif
+    for (; i < w; ++i) {
+        int x0 = 2 * i, x1 = std::min(2 * i + 1, src_w - 1);
+        for (int c = 0; c < 4; ++c) {
+            dst[4 * i + c] = (row0[4 * x0 + c] + row0[4 * x1 + c] + row1[4 * x0 + c] + row1[4 * x1 + c] + 2) / 4;
+        }
+    }
+}
+
+// BGRA to the planes of a 4:2:0 frame, chroma is ceil(w/2) x ceil(h/2)
+void bgraToYUV420(const Uint8 *src, int w, int h, Uint8 *yuv) {
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    auto u = yuv + w * h, v = u + cw * ch;
+    std::vector<Uint8> half(4 * cw);
+    for (int y = 0; y < h; ++y) {
+        bgraToPlane(src + 4ull * w * y, yuv + w * y, w, YUV_Y, 0);
+    }
+    for (int y = 0; y < ch; ++y) {
+        auto row0 = src + 4ull * w * 2 * y, row1 = src + 4ull * w * std::min(2 * y + 1, h - 1);
+        halveRows(row0, row1, half.data(), cw, w);
+        bgraToPlane(half.data(), u + cw * y, cw, YUV_U, 128);
+        bgraToPlane(half.data(), v + cw * y, cw, YUV_V, 128);
+    }
+}
+
+// Streams frames 0..frame_cnt-1 of the snapshot as YUV4MPEG2 into out.
+// Frames are composited and converted as batch jobs on the worker, a few
+// ahead of the one written here, so a slow reader at the other end of a
+// pipe is what sets the pace.
+bool exportY4M(const ProjectSnapshot &snapshot, const ExportOptions &opts, Worker &worker, FILE *out) {
+    int dimx = snapshot.dimx, dimy = snapshot.dimy;
+    int count = std::max(1, std::min<int>(snapshot.frame_cnt, snapshot.frames.size() - 1));
+    size_t yuv_size = (size_t)dimx * dimy + 2ull * ((dimx + 1) / 2) * ((dimy + 1) / 2);
+    if (fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", dimx, dimy, snapshot.frame_rate) < 0) {
+        return false;
+    }
+
+    int ahead = 2 * worker.getThreadCount();
+    auto cancel = Worker::cancelToken();
+    std::deque<std::future<std::vector<Uint8>>> converted;
+    int next = 0;
+    bool ok = true;
+    for (int frame = 0; frame < count && ok; ++frame) {
+        for (; next < count && next <= frame + ahead; ++next) {
+            converted.push_back(worker.submit([&snapshot, &opts, next, dimx, dimy, yuv_size] {
+                std::vector<Uint8> bgra(4ull * dimx * dimy), scratch, yuv(yuv_size);
+                compositeFrame(snapshot, next, opts, bgra.data(), scratch);
+                bgraToYUV420(bgra.data(), dimx, dimy, yuv.data());
+                return yuv;
+            }, Worker::BATCH, cancel));
+        }
+        auto yuv = converted.front().get();
+        converted.pop_front();
+        ok = fputs("FRAME\n", out) >= 0 && fwrite(yuv.data(), 1, yuv.size(), out) == yuv.size();
+    }
+    // nobody's reading anymore if that failed, frames not started are
+    // dropped and the rest still use the snapshot
+    cancel->cancel();
+    for (auto &job : converted) {
+        job.wait();
+    }
+    return fflush(out) == 0 && ok;
+}
+
+// GIF palette: a ramp of grays for the ink, the last entry stands for
+// pixels unchanged since the previous frame
+#define GIF_GRAYS 15
+#define GIF_TRANSPARENT GIF_GRAYS
+#define GIF_CODE_SIZE 4
+
+// Appends GIF LZW codes of pixels to out, split into sub-blocks
+void encodeLZW(const Uint8 *pixels, size_t n, std::vector<Uint8> &out) {
+    const int clear = 1 << GIF_CODE_SIZE, end = clear + 1;
+    // child code of every code for every next pixel, 0 none
+    std::vector<Uint16> children(4096 << GIF_CODE_SIZE);
+    std::vector<Uint8> bytes;
+    Uint32 bits = 0;
+    int nbits = 0, width = GIF_CODE_SIZE + 1, next = end + 1;
+    auto emit = [&](int code) {
+        bits |= code << nbits;
+        nbits += width;
+        for (; nbits >= 8; nbits -= 8, bits >>= 8) {
+            bytes.push_back(bits);
+        }
+    };
+    emit(clear);
+    int code = n ? pixels[0] : -1;
+    for (size_t i = 1; i < n; ++i) {
+        auto &child = children[(code << GIF_CODE_SIZE) + pixels[i]];
+        if (child) {
+            code = child;
+            continue;
+        }
+        emit(code);
+        if (next == 4096) {
+            emit(clear);
+            std::fill(children.begin(), children.end(), 0);
+            width = GIF_CODE_SIZE + 1;
+            next = end + 1;
+        } else {
+            child = next;
+            // the decoder widens a code later than the encoder adds it
+            if (next++ == (1 << width) && width < 12) {
+                ++width;
+            }
+        }
+        code = pixels[i];
+    }
+    if (code >= 0) {
+        emit(code);
+    }
+    emit(end);
+    if (nbits) {
+        bytes.push_back(bits);
+    }
+    out.push_back(GIF_CODE_SIZE);
+    for (size_t i = 0; i < bytes.size(); i += 255) {
+        auto len = std::min<size_t>(255, bytes.size() - i);
+        out.push_back(len);
+        out.insert(out.end(), bytes.begin() + i, bytes.begin() + i + len);
+    }
+    out.push_back(0);
+}
+
+// Palette indices of a composited frame, by luma
+void quantizeFrame(const Uint8 *bgra, int dimx, int dimy, Uint8 *indices) {
+    static Uint8 levels[256];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (int y = 0; y < 256; ++y) {
+            levels[y] = (y * (GIF_GRAYS - 1) + 127) / 255;
+        }
+    });
+    for (int y = 0; y < dimy; ++y) {
+        auto row = indices + (size_t)dimx * y;
+        bgraToPlane(bgra + 4ull * dimx * y, row, dimx, YUV_Y, 0);
+        for (int x = 0; x < dimx; ++x) {
+            row[x] = levels[row[x]];
+        }
+    }
+}
+
+// Image descriptor and data of the part of frame that differs from prev,
+// pixels that didn't change inside it are transparent. Empty if nothing
+// changed; the whole frame if there's no prev.
+std::vector<Uint8> encodeGIFFrame(const Uint8 *frame, const Uint8 *prev, int dimx, int dimy) {
+    Bounds changed;
+    for (int y = 0; y < dimy; ++y) {
+        auto a = frame + (size_t)dimx * y, b = prev ? prev + (size_t)dimx * y : nullptr;
+        int x0 = 0, x1 = dimx - 1;
+        if (b) {
+            for (; x0 < dimx && a[x0] == b[x0]; ++x0) { }
+            if (x0 == dimx) {
+                continue;
+            }
+            for (; a[x1] == b[x1]; --x1) { }
+        }
+        changed.extend(Bounds{x0, y, x1, y});
+    }
+    std::vector<Uint8> out;
+    if (changed.empty()) {
+        return out;
+    }
+    int w = changed.x1 - changed.x0 + 1, h = changed.y1 - changed.y0 + 1;
+    std::vector<Uint8> pixels((size_t)w * h);
+    for (int y = 0; y < h; ++y) {
+        size_t offset = (size_t)dimx * (changed.y0 + y) + changed.x0;
+        for (int x = 0; x < w; ++x) {
+            bool same = prev && frame[offset + x] == prev[offset + x];
+            pixels[(size_t)w * y + x] = same ? GIF_TRANSPARENT : frame[offset + x];
+        }
+    }
+    Uint8 descriptor[] = {0x2c,
+                          Uint8(changed.x0), Uint8(changed.x0 >> 8), Uint8(changed.y0), Uint8(changed.y0 >> 8),
+                          Uint8(w), Uint8(w >> 8), Uint8(h), Uint8(h >> 8), 0};
+    out.assign(descriptor, descriptor + sizeof(descriptor));
+    encodeLZW(pixels.data(), pixels.size(), out);
+    return out;
+}
+
+// Writes frames 0..frame_cnt-1 of the snapshot as a looping GIF. Every
+// frame after the first only carries the rectangle that changed, frames
+// that didn't change at all lengthen the one before. Batches of frames
+// are composited and compressed on the worker, one frame per thread.
+bool exportGIF(const ProjectSnapshot &snapshot, const ExportOptions &opts, Worker &worker, FILE *out) {
+    int dimx = snapshot.dimx, dimy = snapshot.dimy;
+    int count = std::max(1, std::min<int>(snapshot.frame_cnt, snapshot.frames.size() - 1));
+    if (dimx > 0xffff || dimy > 0xffff) {
+        fprintf(stderr, "%dx%d is too large for a GIF\n", dimx, dimy);
+        return false;
+    }
+    std::vector<Uint8> header = {'G', 'I', 'F', '8', '9', 'a',
+                                 Uint8(dimx), Uint8(dimx >> 8), Uint8(dimy), Uint8(dimy >> 8),
+                                 // global palette of 2^(3+1) colors, 8 bits each
+                                 0xf3, 0, 0};
+    for (int i = 0; i < 1 << GIF_CODE_SIZE; ++i) {
+        Uint8 gray = i < GIF_GRAYS ? i * 255 / (GIF_GRAYS - 1) : 0;
+        header.insert(header.end(), {gray, gray, gray});
+    }
+    const char loop[] = "\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00";
+    header.insert(header.end(), loop, loop + sizeof(loop) - 1);
+    bool ok = fwrite(header.data(), 1, header.size(), out) == header.size();
+
+    // in hundredths of a second, rounded so that they add up
+    auto start = [&](int frame) {
+        return (frame * 200 / snapshot.frame_rate + 1) / 2;
+    };
+    std::vector<Uint8> pending;
+    int pending_delay = 0;
+    auto flush = [&] {
+        int delay = std::min(pending_delay, 0xffff);
+        // do not dispose, transparent index
+        Uint8 control[] = {0x21, 0xf9, 4, 1 << 2 | 1, Uint8(delay), Uint8(delay >> 8), GIF_TRANSPARENT, 0};
+        ok = ok && fwrite(control, 1, sizeof(control), out) == sizeof(control) &&
+             fwrite(pending.data(), 1, pending.size(), out) == pending.size();
+    };
+
+    int threads = std::min(count, worker.getThreadCount() + 1);
+    size_t frame_size = (size_t)dimx * dimy;
+    // the last frame of the previous batch first
+    std::vector<Uint8> indices(frame_size * (threads + 1));
+    for (int batch = 0; batch < count && ok; batch += threads) {
+        int n = std::min(threads, count - batch);
+        worker.parallelFor(n, [&](int i) {
+            std::vector<Uint8> bgra(4 * frame_size), scratch;
+            compositeFrame(snapshot, batch + i, opts, bgra.data(), scratch);
+            quantizeFrame(bgra.data(), dimx, dimy, &indices[frame_size * (i + 1)]);
+        });
+        std::vector<std::vector<Uint8>> encoded(n);
+        worker.parallelFor(n, [&](int i) {
+            auto prev = batch + i ? &indices[frame_size * i] : nullptr;
+            encoded[i] = encodeGIFFrame(&indices[frame_size * (i + 1)], prev, dimx, dimy);
+        });
+        for (int i = 0; i < n; ++i) {
+            auto &image = encoded[i];
+            if (!image.empty()) {
+                if (!pending.empty()) {
+                    flush();
+                }
+                pending = std::move(image);
+                pending_delay = 0;
+            }
+            pending_delay += start(batch + i + 1) - start(batch + i);
+        }
+        memcpy(indices.data(), &indices[frame_size * n], frame_size);
+    }
+    flush();
+    ok = ok && fputc(0x3b, out) != EOF;
+    return fflush(out) == 0 && ok;
+}
+
+#endif
@@ -1,19 +1,49 @@
 #ifndef _FRAMEBUFFER_H
 #define _FRAMEBUFFER_H
 
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <string>
 #include <vector>
 
 #include <SDL2/SDL.h>
 
+#include "bounds.h"
 #include "buffer.h"
+#include "layout.h"
+#include "spill.h"
+#include "texarray.h"
+#include "worker.h"
 
 
 class FrameBuffer {
+public:
+    // ATLAS: frames are regions of SDL textures, framesx*framesy per Buffer
+    // ARRAY: Buffers are CPU-only, frames are layers of texture arrays and
+    //        can only be drawn by the Compositor
+    enum Backend { ATLAS, ARRAY };
+
+private:
     SDL_Renderer *_renderer;
     int _frame;
     int _dimx, _dimy;
     int _framesx, _framesy;
     std::vector<Buffer*> _buffers;
+    std::vector<InkBounds> _ink;
+    // texture array layers that don't hold their frame yet
+    std::vector<bool> _stale_layers;
+    // bumped whenever a frame changes
+    std::vector<unsigned> _versions;
+    std::vector<SDL_Rect> _rects;
+    std::vector<size_t> _offsets;
+    TextureArray *_array;
+    Buffer::Upload _upload;
+    size_t _budget = 0;
+    // memory the budget is shared with, e.g. proxies of the frames
+    size_t _other_bytes = 0;
+    SpillFile *_spill = nullptr;
+    std::vector<int> _lru;
 
     int _getBufferIdx(int frame) {
         return (frame / _framesy) / _framesx;
@@ -25,10 +55,115 @@ class FrameBuffer {
         return frame % _framesy;
     }
 
+    void _uploadLayer(int frame) {
+        if (_stale_layers[frame]) {
+            auto buffer = _buffers[_getBufferIdx(frame)];
+            _array->upload(frame, buffer->view(), buffer->getPitch(), SDL_Rect{0, 0, _dimx, _dimy});
+            _stale_layers[frame] = false;
+            buffer->takeDirty([](const SDL_Rect&) { });
+        }
+    }
+
+    // false if the upload was put off, see Buffer::update
+    bool _updateFrame(int frame, UploadRing *ring) {
+        auto buffer = _buffers[_getBufferIdx(frame)];
+        if (!_array) {
+            return buffer->update(ring);
+        }
+        if (ring && !ring->failed()) {
+            _rects.clear();
+            buffer->takeDirty([&](const SDL_Rect &rect) {
+                _rects.push_back(rect);
+            });
+            if (_rects.empty()) {
+                return true;
+            }
+            if (ring->stage(buffer->getPixel(0, 0), buffer->getPitch(), _rects, _offsets)) {
+                _array->uploadStaged(frame, _rects, _offsets);
+                ring->submit();
+                return true;
+            }
+            if (!ring->failed()) {
+                for (auto &rect : _rects) {
+                    buffer->deferUpload(rect);
+                }
+                return false;
+            }
+            for (auto &rect : _rects) {
+                _array->upload(frame, buffer->getPixel(0, 0), buffer->getPitch(), rect);
+            }
+            return true;
+        }
+        buffer->takeDirty([&](const SDL_Rect &rect) {
+            _array->upload(frame, buffer->getPixel(0, 0), buffer->getPitch(), rect);
+        });
+        return true;
+    }
+
+    struct FrameTile {
+        int frame, tx, ty;
+    };
+
+    void _packFrames(int idx, Worker &worker) {
+        // ink bounds of packed frames can't be rescanned without unpacking
+        int per_buffer = _framesx * _framesy;
+        for (int frame = idx * per_buffer; frame < (idx + 1) * per_buffer; ++frame) {
+            getInkBounds(frame);
+        }
+        _buffers[idx]->startPack(worker);
+    }
+
+    // Packs, then spills, least recently used buffers first until the
+    // frames fit. Buffers being packed or spilled count as freed already,
+    // so are raw ones once their pack starts.
+    void _enforceBudget(Worker &worker, Buffer *active) {
+        if (!_budget || !_spill) {
+            return;
+        }
+        auto used = getBytes() + _other_bytes;
+        if (used <= _budget) {
+            return;
+        }
+        _lru.clear();
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            auto buff = _buffers[i];
+            if (buff->isPacking() || buff->isSpilling()) {
+                used -= buff->getBytes();
+            } else if (buff != active && !buff->isSpilled()) {
+                _lru.push_back(i);
+            }
+        }
+        std::sort(_lru.begin(), _lru.end(), [this](int a, int b) {
+            return _buffers[a]->lastUsed() < _buffers[b]->lastUsed();
+        });
+        for (int idx : _lru) {
+            if (used <= _budget) {
+                break;
+            }
+            auto buff = _buffers[idx];
+            buff->cancelDecode();
+            auto bytes = buff->getBytes();
+            if (buff->isPacked()) {
+                buff->startSpill(worker, *_spill);
+            } else {
+                _packFrames(idx, worker);
+            }
+            if (buff->isPacking() || buff->isSpilling()) {
+                used -= bytes;
+            }
+        }
+    }
+
 public:
-    FrameBuffer(SDL_Renderer *renderer, int total_frames, int dimx, int dimy, int framesx, int framesy)
-        : _renderer(renderer), _frame(0), _dimx(dimx), _dimy(dimy), _framesx(framesx), _framesy(framesy)
+    FrameBuffer(SDL_Renderer *renderer, int total_frames, int dimx, int dimy, int framesx, int framesy,
+                Backend backend=ATLAS, Buffer::Upload upload=Buffer::STATIC)
+        : _renderer(renderer), _frame(0), _dimx(dimx), _dimy(dimy), _framesx(framesx), _framesy(framesy),
+          _array(nullptr), _upload(upload)
     {
+        if (backend == ARRAY) {
+            _framesx = _framesy = framesx = framesy = 1;
+            _array = new TextureArray(dimx, dimy, total_frames);
+        }
         int n_buffers = (total_frames + framesx * framesy - 1) / (framesx * framesy);
         _buffers.reserve(n_buffers);
         for (int i = 0; i < n_buffers; ++i) {
@@ -40,10 +175,200 @@ public:
         for (Buffer *buff : _buffers) {
             delete buff;
         }
+        delete _array;
+        delete _spill;
+    }
+
+    // Once the frames take more than budget bytes, the least recently
+    // used ones are packed and then spilled to a scratch file in dir.
+    void setMemoryBudget(size_t budget, const std::string &dir) {
+        _budget = budget;
+        if (!_spill) {
+            _spill = new SpillFile(dir);
+        }
+    }
+
+    size_t getMemoryBudget() const {
+        return _budget;
+    }
+
+    // bytes taken outside the frames that count against the budget,
+    // frames are packed and spilled to make room for them
+    void setOtherBytes(size_t bytes) {
+        _other_bytes = bytes;
+    }
+
+    Layout getLayout() const {
+        return Layout{_framesx, _framesy};
+    }
+
+    // moves the tiles of every frame into Buffers of the new layout
+    void setLayout(Layout layout) {
+        if (_array || (layout.framesx == _framesx && layout.framesy == _framesy)) {
+            return;
+        }
+        auto frames = getFrameCapacity();
+        auto old = getLayout();
+        std::vector<Buffer*> old_buffers;
+        old_buffers.swap(_buffers);
+        std::vector<PackedFrame> old_packed(old_buffers.size());
+        for (int frame = 0; frame < frames; ++frame) {
+            getInkBounds(frame);
+        }
+        // tiles the journal hasn't seen yet move along
+        std::vector<FrameTile> unsaved;
+        for (int i = 0; i < (int)old_buffers.size(); ++i) {
+            auto &mask = old_buffers[i]->getUnsaved();
+            int ctx = mask.getCellTilesX(), cty = mask.getCellTilesY();
+            mask.forEachTile([&](int tx, int ty) {
+                int frame = i * old.frames() + tx / ctx * old.framesy + ty / cty;
+                unsaved.push_back(FrameTile{frame, tx % ctx, ty % cty});
+            });
+        }
+
+        _framesx = layout.framesx;
+        _framesy = layout.framesy;
+        for (int i = 0; i < layout.textures(frames); ++i) {
+            addNewFrame();
+        }
+        loadFrames([&](int frame, PackedFrame &tiles, Bounds &ink) {
+            if (frame >= frames) {
+                return;
+            }
+            int idx = (frame / old.framesy) / old.framesx;
+            if (old_packed[idx].empty()) {
+                old_packed[idx] = old_buffers[idx]->getPacked();
+            }
+            tiles = cellTiles(old_packed[idx], old_buffers[idx]->getGrid(),
+                              (frame / old.framesy) % old.framesx, frame % old.framesy);
+            ink = _ink[frame].get(nullptr, 0);
+        });
+        for (Buffer *buff : old_buffers) {
+            delete buff;
+        }
+        for (auto &t : unsaved) {
+            auto buffer = _buffers[_getBufferIdx(t.frame)];
+            auto &grid = buffer->getGrid();
+            buffer->markUnsaved(_getOffsetX(t.frame) * grid.getCellTilesX() + t.tx,
+                                _getOffsetY(t.frame) * grid.getCellTilesY() + t.ty);
+        }
+    }
+
+    // calls fn(frame, tx, ty, data, size) with every tile written since the
+    // last call, encoded. tx and ty are within the frame.
+    template<typename F>
+    void takeUnsaved(F fn) {
+        int per_buffer = _framesx * _framesy;
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            auto &grid = _buffers[i]->getGrid();
+            int ctx = grid.getCellTilesX(), cty = grid.getCellTilesY();
+            _buffers[i]->takeUnsaved([&](int tx, int ty, const Uint8 *data, size_t size) {
+                fn(i * per_buffer + tx / ctx * _framesy + ty / cty, tx % ctx, ty % cty, data, size);
+            });
+        }
+    }
+
+    // writes an encoded tile of a frame, see takeUnsaved
+    void putTile(int frame, int tx, int ty, const Uint8 *data, size_t size, const Bounds &ink) {
+        auto buffer = _buffers[_getBufferIdx(frame)];
+        auto &grid = buffer->getGrid();
+        buffer->putTile(_getOffsetX(frame) * grid.getCellTilesX() + tx,
+                        _getOffsetY(frame) * grid.getCellTilesY() + ty, data, size);
+        _ink[frame].set(ink);
+        _stale_layers[frame] = _array;
+        ++_versions[frame];
+    }
+
+    // replaces one frame with tiles on a grid of their own, see putCell
+    void putFrame(int frame, const PackedFrame &tiles, const Bounds &ink) {
+        int offx = _getOffsetX(frame), offy = _getOffsetY(frame);
+        auto buffer_ink = ink.empty() ? ink : Bounds{ink.x0 + offx * _dimx, ink.y0 + offy * _dimy,
+                                                     ink.x1 + offx * _dimx, ink.y1 + offy * _dimy};
+        _buffers[_getBufferIdx(frame)]->putCell(offx, offy, tiles, buffer_ink);
+        _ink[frame].set(ink);
+        _stale_layers[frame] = _array;
+        ++_versions[frame];
+    }
+
+    // Replaces every frame with fn(frame, tiles, ink), ink being the
+    // bounding box of the tiles. Frames left blank by fn are cleared.
+    template<typename F>
+    void loadFrames(F fn) {
+        int per_buffer = _framesx * _framesy;
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            auto buffer = _buffers[i];
+            PackedFrame packed;
+            Bounds buffer_ink;
+            for (int frame = i * per_buffer; frame < (i + 1) * per_buffer; ++frame) {
+                PackedFrame tiles;
+                Bounds ink;
+                fn(frame, tiles, ink);
+                int offx = _getOffsetX(frame), offy = _getOffsetY(frame);
+                setCellTiles(packed, buffer->getGrid(), offx, offy, tiles);
+                _ink[frame].set(ink);
+                _stale_layers[frame] = _array;
+                ++_versions[frame];
+                if (!ink.empty()) {
+                    buffer_ink.extend(Bounds{ink.x0 + offx * _dimx, ink.y0 + offy * _dimy,
+                                             ink.x1 + offx * _dimx, ink.y1 + offy * _dimy});
+                }
+            }
+            buffer->setPacked(packed, buffer_ink);
+        }
+    }
+
+    // calls fn(frame, tiles, ink) for every frame, in order
+    template<typename F>
+    void saveFrames(F fn) {
+        int per_buffer = _framesx * _framesy;
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            auto buffer = _buffers[i];
+            auto packed = buffer->getPacked();
+            for (int frame = i * per_buffer; frame < (i + 1) * per_buffer; ++frame) {
+                auto &ink = getInkBounds(frame);
+                fn(frame, cellTiles(packed, buffer->getGrid(), _getOffsetX(frame), _getOffsetY(frame)), ink);
+            }
+        }
+    }
+
+    // saveFrames in two halves: what the frames are is taken now, the
+    // returned function appends their tiles and inks on any thread, see
+    // Buffer::deferPacked
+    std::function<void(std::vector<PackedFrame>&, std::vector<Bounds>&)> deferFrames() {
+        int per_buffer = _framesx * _framesy;
+        std::vector<std::function<PackedFrame()>> sources;
+        std::vector<TileGrid> grids;
+        std::vector<Bounds> inks;
+        std::vector<SDL_Point> cells;
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            sources.push_back(_buffers[i]->deferPacked());
+            grids.push_back(_buffers[i]->getGrid());
+            for (int frame = i * per_buffer; frame < (i + 1) * per_buffer; ++frame) {
+                inks.push_back(getInkBounds(frame));
+                cells.push_back(SDL_Point{_getOffsetX(frame), _getOffsetY(frame)});
+            }
+        }
+        return [sources, grids, inks, cells, per_buffer](std::vector<PackedFrame> &frames, std::vector<Bounds> &res) {
+            for (size_t i = 0; i < sources.size(); ++i) {
+                auto packed = sources[i]();
+                for (size_t frame = i * per_buffer; frame < (i + 1) * per_buffer; ++frame) {
+                    frames.push_back(cellTiles(packed, grids[i], cells[frame].x, cells[frame].y));
+                }
+            }
+            res.insert(res.end(), inks.begin(), inks.end());
+        };
+    }
+
+    Backend getBackend() const {
+        return _array ? ARRAY : ATLAS;
     }
 
     void addNewFrame() {
-        _buffers.push_back(new Buffer(_renderer, _dimx * _framesx, _dimy * _framesy));
+        _buffers.push_back(new Buffer(_array ? nullptr : _renderer, _dimx * _framesx, _dimy * _framesy,
+                                      _upload, _dimx, _dimy));
+        _ink.resize(getFrameCapacity());
+        _stale_layers.resize(getFrameCapacity());
+        _versions.resize(getFrameCapacity());
     }
 
     int &getCurrentFrame() {
@@ -59,22 +384,301 @@ public:
         return pxl;
     }
 
-    void updateActive() {
-        auto frame = getCurrentFrame();
-        _buffers[_getBufferIdx(frame)]->update();
+    void touch(int x0, int y0, int x1, int y1, bool ink) {
+        auto b = Bounds{x0, y0, x1, y1}.clipped(_dimx, _dimy);
+        auto offx = _getOffsetX(_frame) * _dimx, offy = _getOffsetY(_frame) * _dimy;
+        auto buffer = _buffers[_getBufferIdx(_frame)];
+        buffer->markDirty(Bounds{b.x0 + offx, b.y0 + offy, b.x1 + offx, b.y1 + offy});
+        buffer->use();
+        ++_versions[_frame];
+        if (ink) {
+            _ink[_frame].draw(b);
+        } else {
+            _ink[_frame].erase(b);
+        }
+    }
+
+    unsigned getVersion(int frame) const {
+        return _versions[frame];
+    }
+
+    const Bounds &getInkBounds(int frame) {
+        if (!_ink[frame].stale()) {
+            return _ink[frame].get(nullptr, 0);
+        }
+        auto buffer = _buffers[_getBufferIdx(frame)];
+        auto origin = buffer->getPixel(_getOffsetX(frame) * _dimx, _getOffsetY(frame) * _dimy);
+        return _ink[frame].get(origin, buffer->getPitch());
+    }
+
+    // false if the upload was put off, see Buffer::update
+    bool updateActive(UploadRing *ring=nullptr) {
+        return _updateFrame(getCurrentFrame(), ring);
+    }
+
+    // Uploads every frame drawn on since the last call, the current one or
+    // not. False if any upload was put off.
+    bool update(UploadRing *ring=nullptr) {
+        int per_buffer = _framesx * _framesy;
+        bool res = true;
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            if (_buffers[i]->isDirty()) {
+                res = _updateFrame(i * per_buffer, ring) && res;
+            }
+        }
+        return res;
     }
 
     void renderActive(int tintr=255, int tintg=255, int tintb=255) {
         auto frame = getCurrentFrame();
-        SDL_Rect what;
-        what.x = _getOffsetX(frame) * _dimx;
-        what.y = _getOffsetY(frame) * _dimy;
-        what.w = _dimx;
-        what.h = _dimy;
+        if (_array) {
+            return;
+        }
+        auto &ink = getInkBounds(frame);
+        if (ink.empty()) {
+            return;
+        }
+        auto what = ink.rect(_getOffsetX(frame) * _dimx, _getOffsetY(frame) * _dimy);
+        auto where = ink.rect();
 
         auto buffer = _buffers[_getBufferIdx(frame)];
+        buffer->use();
+        buffer->update();
         buffer->tint(tintr, tintg, tintb);
-        buffer->render(&what, nullptr);
+        buffer->render(&what, &where);
+    }
+
+    // false if the frame is blank and can be skipped
+    bool getLayer(int frame, Layer &layer, int tintr=255, int tintg=255, int tintb=255) {
+        auto &ink = getInkBounds(frame);
+        if (ink.empty()) {
+            return false;
+        }
+        auto rect = ink.rect();
+        // tiles whose upload was put off go now, stale layers are worse
+        if (_buffers[_getBufferIdx(frame)]->isDirty()) {
+            _updateFrame(frame, nullptr);
+        }
+        if (_array) {
+            _uploadLayer(frame);
+            layer = Layer{nullptr, _array->getTexture(frame), _array->getLayer(frame),
+                          0, 0, _dimx, _dimy, tintr/255.f, tintg/255.f, tintb/255.f, rect};
+            return true;
+        }
+        auto buffer = _buffers[_getBufferIdx(frame)];
+        buffer->use();
+        layer = buffer->getLayer(
+            _getOffsetX(frame) * _dimx, _getOffsetY(frame) * _dimy, tintr, tintg, tintb, &rect);
+        return true;
+    }
+
+    // Packs the buffers nobody has used for idle_seconds on the worker and
+    // frees the raw pixels of those that are done. Textures of packed
+    // buffers that went idle again are dropped too.
+    void compact(Worker &worker, double idle_seconds) {
+        auto now = Buffer::Clock::now();
+        auto active = _buffers[_getBufferIdx(_frame)];
+        active->use();
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            auto buffer = _buffers[i];
+            buffer->finishPack();
+            buffer->finishSpill();
+            if (buffer == active || idle_seconds <= 0 || buffer->idleSeconds(now) < idle_seconds) {
+                continue;
+            }
+            if (buffer->isPacked()) {
+                buffer->dropTexture();
+                continue;
+            }
+            _packFrames(i, worker);
+        }
+        _enforceBudget(worker, active);
+    }
+
+    // The tiles and ink of a frame if that's cheap, i.e. the frame is
+    // packed and in memory
+    bool peekFrame(int frame, PackedFrame &tiles, Bounds &ink) {
+        auto buffer = _buffers[_getBufferIdx(frame)];
+        if (!buffer->isPacked() || buffer->isSpilled() || buffer->isPacking() || _ink[frame].stale()) {
+            return false;
+        }
+        tiles = cellTiles(buffer->getPacked(), buffer->getGrid(), _getOffsetX(frame), _getOffsetY(frame));
+        ink = _ink[frame].get(nullptr, 0);
+        return true;
+    }
+
+    // true if the frame can be drawn without decoding or uploading anything
+    bool isReady(int frame) {
+        if (!_ink[frame].stale() && _ink[frame].get(nullptr, 0).empty()) {
+            return true;
+        }
+        auto buffer = _buffers[_getBufferIdx(frame)];
+        if (buffer->isDirty()) {
+            return false;
+        }
+        if (_array) {
+            return !_stale_layers[frame];
+        }
+        return buffer->hasTexture();
+    }
+
+    // Gets the frames ready in the background, nearest first: spilled ones
+    // are read back in and packed ones that aren't on the GPU decoded.
+    // Decodes take their room in the memory budget when they start, none
+    // start once it's used up. Loads and decodes of other frames that
+    // haven't started are dropped.
+    void prefetch(Worker &worker, const std::vector<int> &frames) {
+        std::vector<bool> wanted(_buffers.size());
+        size_t used = _budget ? getBytes() + _other_bytes : 0;
+        for (int frame : frames) {
+            auto idx = _getBufferIdx(frame);
+            auto buffer = _buffers[idx];
+            wanted[idx] = true;
+            buffer->startLoad(worker);
+            if (isReady(frame) || buffer->isDecoding()) {
+                continue;
+            }
+            if (_budget && used + buffer->getRawBytes() > _budget) {
+                continue;
+            }
+            auto before = buffer->getBytes();
+            buffer->startDecode(worker);
+            used += buffer->getBytes() - before;
+        }
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            if (wanted[i]) {
+                continue;
+            }
+            if (_buffers[i]->isLoading()) {
+                _buffers[i]->cancelLoad();
+            }
+            if (_buffers[i]->isDecoding()) {
+                _buffers[i]->cancelDecode();
+            }
+        }
+    }
+
+    // Uploads up to max of the frames whose pixels are at hand, nearest
+    // first, so that drawing them doesn't have to. Returns how many were.
+    int upload(const std::vector<int> &frames, int max) {
+        int res = 0;
+        for (int frame : frames) {
+            if (res >= max) {
+                break;
+            }
+            auto buffer = _buffers[_getBufferIdx(frame)];
+            if (isReady(frame) || buffer->isPacking() || (buffer->isPacked() && !buffer->isDecoded())) {
+                continue;
+            }
+            if (_array) {
+                _uploadLayer(frame);
+                _updateFrame(frame, nullptr);
+            } else {
+                buffer->prepareTexture();
+            }
+            ++res;
+        }
+        return res;
+    }
+
+    size_t getTextureBytes() const {
+        size_t res = 0;
+        for (Buffer *buff : _buffers) {
+            res += buff->hasTexture() ? 4ull * _dimx * _framesx * _dimy * _framesy : 0;
+        }
+        return res;
+    }
+
+    // Drops textures of packed buffers not holding any of keep until all
+    // take at most budget bytes, those playback from frame reaches last first
+    void limitTextures(size_t budget, const std::vector<int> &keep, int frame, int frame_cnt) {
+        auto used = getTextureBytes();
+        if (!budget || used <= budget) {
+            return;
+        }
+        std::vector<bool> kept(_buffers.size());
+        for (int f : keep) {
+            kept[_getBufferIdx(f)] = true;
+        }
+        int per_buffer = _framesx * _framesy;
+        auto reached = [&](int idx) {
+            int first = idx * per_buffer;
+            if (first >= frame_cnt) {
+                return frame_cnt;
+            }
+            return (first - frame + frame_cnt) % frame_cnt;
+        };
+        _lru.clear();
+        for (int i = 0; i < (int)_buffers.size(); ++i) {
+            if (!kept[i] && _buffers[i]->hasTexture() && _buffers[i]->isPacked()) {
+                _lru.push_back(i);
+            }
+        }
+        std::sort(_lru.begin(), _lru.end(), [&](int a, int b) {
+            return reached(a) > reached(b);
+        });
+        size_t bytes = 4ull * _dimx * _framesx * _dimy * _framesy;
+        for (int idx : _lru) {
+            if (used <= budget) {
+                break;
+            }
+            _buffers[idx]->dropTexture();
+            used -= bytes;
+        }
+    }
+
+    // true if a frame's spilled tiles couldn't be read back
+    bool isDamaged() const {
+        for (Buffer *buff : _buffers) {
+            if (buff->isDamaged()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int getSpilledCount() const {
+        int res = 0;
+        for (Buffer *buff : _buffers) {
+            res += buff->isSpilled();
+        }
+        return res;
+    }
+
+    size_t getSpilledBytes() const {
+        size_t res = 0;
+        for (Buffer *buff : _buffers) {
+            res += buff->getSpilledBytes();
+        }
+        return res;
+    }
+
+    int getPackedCount() const {
+        int res = 0;
+        for (Buffer *buff : _buffers) {
+            res += buff->isPacked();
+        }
+        return res;
+    }
+
+    int getBufferCount() const {
+        return _buffers.size();
+    }
+
+    size_t getBytes() const {
+        size_t res = 0;
+        for (Buffer *buff : _buffers) {
+            res += buff->getBytes();
+        }
+        return res;
+    }
+
+    int offsetFrame(int delta, int frame_count=0) const {
+        auto frame_capacity = getFrameCapacity();
+        if (frame_count == 0 || frame_count > frame_capacity) {
+            frame_count = frame_capacity;
+        }
+        return ((_frame + delta) % frame_count + frame_count) % frame_count;
     }
 
     void prevFrame(int frame_count=0) {
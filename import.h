@@ -0,0 +1,379 @@
+#ifndef _IMPORT_H
+#define _IMPORT_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <png.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include "bounds.h"
+#include "buffer.h"
+#include "codec.h"
+#include "framebuffer.h"
+#include "tiles.h"
+#include "worker.h"
+
+
+// RGBA pixels as frames store them: BGRA in memory. Alpha stays as it is,
+// layers are weighted by it when they're added up, but fully transparent
+// pixels become 0 so they take no room and don't count as ink.
+void rgbaToFrame(const Uint8 *src, Uint8 *dst, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i green = _mm_set1_epi32(0x0000ff00);
+    const __m128i low = _mm_set1_epi32(0x000000ff);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        auto px = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+        // swap the bytes of red and blue
+        auto res = _mm_or_si128(_mm_and_si128(px, _mm_or_si128(alpha, green)),
+                                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(px, 16), low),
+                                             _mm_slli_epi32(_mm_and_si128(px, low), 16)));
+        auto clear = _mm_cmpeq_epi32(_mm_and_si128(px, alpha), zero);
+        _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_andnot_si128(clear, res));
+    }
+#endif
+    for (; i < n; ++i) {
+        auto s = src + 4 * i;
+        auto d = dst + 4 * i;
+        bool clear = !s[3];
+        d[0] = clear ? 0 : s[2];
+        d[1] = clear ? 0 : s[1];
+        d[2] = clear ? 0 : s[0];
+        d[3] = s[3];
+    }
+}
+
+// Takes the RGBA rows of a w x h image one at a time and puts them
+// centered on a dimx x dimy canvas, shrunk by a box filter if the image
+// is larger. Colors are weighted by alpha, so those of transparent pixels
+// don't bleed into the edges. Only a row of sums is kept, never the whole
+// image.
+class RowScaler {
+    int _w, _h, _ow, _oh, _offx, _offy;
+    Uint8 *_canvas;
+    int _pitch;
+    // colors times alpha, then alpha
+    std::vector<Uint64> _sums;
+    std::vector<Uint32> _counts;
+    std::vector<int> _columns;
+    std::vector<Uint8> _row;
+    int _y = 0, _out_y = 0;
+
+    void _flush() {
+        for (int x = 0; x < _ow; ++x) {
+            auto n = std::max<Uint32>(1, _counts[x]);
+            auto sum = &_sums[4 * x];
+            for (int c = 0; c < 3; ++c) {
+                _row[4 * x + c] = sum[3] ? (sum[c] + sum[3] / 2) / sum[3] : 0;
+            }
+            _row[4 * x + 3] = (sum[3] + n / 2) / n;
+        }
+        rgbaToFrame(_row.data(), _canvas + (_offy + _out_y) * _pitch + 4 * _offx, _ow);
+        std::fill(_sums.begin(), _sums.end(), 0);
+        std::fill(_counts.begin(), _counts.end(), 0);
+    }
+
+public:
+    RowScaler(int w, int h, int dimx, int dimy, Uint8 *canvas) : _w(w), _h(h), _canvas(canvas), _pitch(4 * dimx) {
+        double scale = std::max({1., w / (double)dimx, h / (double)dimy});
+        _ow = std::max(1, std::min(dimx, (int)(w / scale)));
+        _oh = std::max(1, std::min(dimy, (int)(h / scale)));
+        _offx = (dimx - _ow) / 2;
+        _offy = (dimy - _oh) / 2;
+        if (_ow < _w || _oh < _h) {
+            _sums.resize(4 * _ow);
+            _counts.resize(_ow);
+            _columns.resize(_w);
+            for (int x = 0; x < _w; ++x) {
+                _columns[x] = (long long)x * _ow / _w;
+            }
+            _row.resize(4 * _ow);
+        }
+    }
+
+    // the area of the canvas the image ends up in
+    Bounds area() const {
+        return Bounds{_offx, _offy, _offx + _ow - 1, _offy + _oh - 1};
+    }
+
+    void row(const Uint8 *rgba) {
+        if (_y >= _h) {
+            return;
+        }
+        if (_columns.empty()) {
+            rgbaToFrame(rgba, _canvas + (_offy + _y) * _pitch + 4 * _offx, _w);
+            ++_y;
+            return;
+        }
+        int out_y = (long long)_y * _oh / _h;
+        if (out_y != _out_y) {
+            _flush();
+            _out_y = out_y;
+        }
+        for (int x = 0; x < _w; ++x) {
+            auto sum = &_sums[4 * _columns[x]];
+            auto a = rgba[4 * x + 3];
+            for (int c = 0; c < 3; ++c) {
+                sum[c] += rgba[4 * x + c] * a;
+            }
+            sum[3] += a;
+            ++_counts[_columns[x]];
+        }
+        if (++_y == _h) {
+            _flush();
+        }
+    }
+};
+
+bool readPPM(const char *path, FILE *file, int dimx, int dimy, Uint8 *canvas, Bounds &area) {
+    int w, h, maxval;
+    if (fscanf(file, "P6 %d %d %d", &w, &h, &maxval) != 3 || fgetc(file) == EOF ||
+            w <= 0 || h <= 0 || maxval != 255) {
+        fprintf(stderr, "%s: only 8-bit binary PPM files are supported\n", path);
+        return false;
+    }
+    RowScaler scaler(w, h, dimx, dimy, canvas);
+    std::vector<Uint8> rgb(3 * w), rgba(4 * w);
+    for (int y = 0; y < h; ++y) {
+        if (fread(rgb.data(), 1, rgb.size(), file) != rgb.size()) {
+            fprintf(stderr, "%s: file is cut short\n", path);
+            return false;
+        }
+        for (int x = 0; x < w; ++x) {
+            memcpy(&rgba[4 * x], &rgb[3 * x], 3);
+            rgba[4 * x + 3] = 255;
+        }
+        scaler.row(rgba.data());
+    }
+    area = scaler.area();
+    return true;
+}
+
+bool readPNG(const char *path, FILE *file, int dimx, int dimy, Uint8 *canvas, Bounds &area) {
+    auto png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    auto info = png ? png_create_info_struct(png) : nullptr;
+    if (!info) {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        return false;
+    }
+    // errors longjmp back here, so everything lives out here
+    std::vector<Uint8> image;
+    std::vector<png_bytep> rows;
+    std::unique_ptr<RowScaler> scaler;
+    if (setjmp(png_jmpbuf(png))) {
+        fprintf(stderr, "%s: damaged PNG file\n", path);
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    png_init_io(png, file);
+    png_read_info(png, info);
+    // whatever the file holds, as 8-bit RGBA
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    int w = png_get_image_width(png, info), h = png_get_image_height(png, info);
+    scaler.reset(new RowScaler(w, h, dimx, dimy, canvas));
+    // interlaced images only come out whole after the last pass
+    image.resize(passes > 1 ? 4ull * w * h : 4ull * w);
+    rows.resize(passes > 1 ? h : 1);
+    for (size_t y = 0; y < rows.size(); ++y) {
+        rows[y] = &image[4ull * w * y];
+    }
+    if (passes > 1) {
+        png_read_image(png, rows.data());
+    }
+    for (int y = 0; y < h; ++y) {
+        if (passes > 1) {
+            scaler->row(rows[y]);
+        } else {
+            png_read_row(png, rows[0], nullptr);
+            scaler->row(rows[0]);
+        }
+    }
+    area = scaler->area();
+    png_destroy_read_struct(&png, &info, nullptr);
+    return true;
+}
+
+// Reads a PNG or binary PPM onto a blank dimx x dimy canvas, ink is set
+// to the bounding box of what's not transparent
+bool readImage(const char *path, int dimx, int dimy, Uint8 *canvas, Bounds &ink) {
+    auto file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    Uint8 magic[8] = {0};
+    bool ok = fread(magic, 1, sizeof magic, file) == sizeof magic && fseek(file, 0, SEEK_SET) == 0;
+    Bounds area;
+    if (ok && !png_sig_cmp(magic, 0, sizeof magic)) {
+        ok = readPNG(path, file, dimx, dimy, canvas, area);
+    } else if (ok && magic[0] == 'P' && magic[1] == '6') {
+        ok = readPPM(path, file, dimx, dimy, canvas, area);
+    } else {
+        fprintf(stderr, "%s: not a PNG or PPM file\n", path);
+        ok = false;
+    }
+    fclose(file);
+    ink = Bounds{};
+    for (int y = area.y0; ok && y <= area.y1; ++y) {
+        auto row = (const Uint32*)(canvas + 4ull * dimx * y);
+        int x0 = area.x0, x1 = area.x1;
+        while (x0 <= x1 && !row[x0]) {
+            ++x0;
+        }
+        while (x1 >= x0 && !row[x1]) {
+            --x1;
+        }
+        if (x0 <= x1) {
+            ink.extend(Bounds{x0, y, x1, y});
+        }
+    }
+    return ok;
+}
+
+// Puts n into a sequence pattern in place of its one %d or %0Nd, %% is
+// a literal %. Any other conversion makes it fail, the pattern comes
+// from the command line and never goes through printf.
+bool formatFrameNumber(const char *pattern, int n, std::string &res) {
+    res.clear();
+    bool found = false;
+    for (auto p = pattern; *p; ++p) {
+        if (*p != '%') {
+            res += *p;
+            continue;
+        }
+        if (p[1] == '%') {
+            res += '%';
+            ++p;
+            continue;
+        }
+        int width = 0;
+        auto q = p + 1;
+        if (*q == '0') {
+            while (*q >= '0' && *q <= '9' && width < 100) {
+                width = 10 * width + (*q++ - '0');
+            }
+        }
+        if (*q != 'd' || found) {
+            return false;
+        }
+        auto digits = std::to_string(n);
+        res.append(std::max<int>(0, width - (int)digits.size()), '0');
+        res += digits;
+        found = true;
+        p = q;
+    }
+    return found;
+}
+
+// Files of a numbered sequence: pattern has a %d or %0Nd for the number,
+// the first of 0 and 1 that exists starts it and the first gap ends it.
+// A pattern without a % is a single file.
+std::vector<std::string> sequenceFiles(const char *pattern) {
+    std::vector<std::string> res;
+    if (!strchr(pattern, '%')) {
+        res.push_back(pattern);
+        return res;
+    }
+    std::string path;
+    if (!formatFrameNumber(pattern, 0, path)) {
+        fprintf(stderr, "%s: the pattern needs one %%d or %%0Nd for the frame number\n", pattern);
+        return res;
+    }
+    for (int n = 0; formatFrameNumber(pattern, n, path); ++n) {
+        if (access(path.c_str(), R_OK) == 0) {
+            res.push_back(path);
+        } else if (n > 1 || !res.empty()) {
+            break;
+        }
+    }
+    return res;
+}
+
+// Decodes images as batch jobs on the worker and hands them over in order
+// as tiles on a frame's grid. A few images ahead of the consumer are
+// decoded at most, so memory stays at a canvas per thread plus what the
+// frames take. fn(index, tiles, ink) runs on the calling thread; failed
+// images come out blank.
+template<typename F>
+void decodeImages(const std::vector<std::string> &paths, int dimx, int dimy, Worker &worker, F fn) {
+    int count = paths.size();
+    int ahead = 2 * worker.getThreadCount();
+    struct Result {
+        PackedFrame tiles;
+        Bounds ink;
+    };
+    std::deque<std::future<Result>> decoding;
+    int next = 0;
+    for (int i = 0; i < count; ++i) {
+        for (; next < count && next <= i + ahead; ++next) {
+            auto path = paths[next];
+            decoding.push_back(worker.submit([path, dimx, dimy] {
+                Result res;
+                std::vector<Uint8> canvas(4ull * dimx * dimy);
+                if (readImage(path.c_str(), dimx, dimy, canvas.data(), res.ink) && !res.ink.empty()) {
+                    res.tiles = packPixels(canvas.data(), 4 * dimx, TileGrid(dimx, dimy));
+                }
+                return res;
+            }, Worker::BATCH));
+        }
+        auto res = decoding.front().get();
+        decoding.pop_front();
+        fn(i, res.tiles, res.ink);
+    }
+}
+
+// Loads a numbered sequence into consecutive frames starting at first,
+// or its first image into the background if first is negative. after()
+// runs after every frame, to keep memory in check. Returns the number
+// of images loaded, or -1 if there are none or they don't all fit.
+template<typename F>
+int importSequence(const char *pattern, FrameBuffer &fb, Buffer &background, int first, Worker &worker, F after) {
+    auto paths = sequenceFiles(pattern);
+    auto &grid = background.getGrid();
+    if (paths.empty()) {
+        fprintf(stderr, "%s: no images to import\n", pattern);
+        return -1;
+    }
+    if (first < 0) {
+        paths.resize(1);
+    } else if ((int)paths.size() > fb.getFrameCapacity() - first) {
+        fprintf(stderr, "%s: %d images don't fit from frame %d of %d\n", pattern, (int)paths.size(), first,
+                fb.getFrameCapacity());
+        return -1;
+    }
+    decodeImages(paths, grid.getDimX(), grid.getDimY(), worker, [&](int i, const PackedFrame &tiles, const Bounds &ink) {
+        if (first < 0) {
+            background.putCell(0, 0, tiles, ink);
+        } else {
+            fb.putFrame(first + i, tiles, ink);
+        }
+        after();
+    });
+    return paths.size();
+}
+
+// The frames an import needs, so the frame buffer can be made that large
+int importFrames(const char *pattern, int first) {
+    return pattern && first >= 0 ? first + (int)sequenceFiles(pattern).size() : 0;
+}
+
+#endif
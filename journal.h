@@ -0,0 +1,309 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <SDL2/SDL.h>
+
+#include "bounds.h"
+#include "buffer.h"
+#include "framebuffer.h"
+#include "project.h"
+#include "strokes.h"
+#include "worker.h"
+
+
+Uint32 crc32(const Uint8 *data, size_t size, Uint32 crc=0) {
+    static Uint32 table[256];
+    if (!table[1]) {
+        for (Uint32 i = 0; i < 256; ++i) {
+            Uint32 c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Write-ahead journal next to the project file. Every checkpoint appends
+// one batch with the tiles written since the previous one:
+//   Uint32 BATCH_MAGIC, Uint32 size, Uint32 crc32 of the payload
+// and a payload of a Uint64 mark, also written to the stroke log, then
+// frames, each
+//   Uint32 frame, Sint32 x0, y0, x1, y1 (ink), Uint32 tiles
+// followed by the tiles
+//   Uint16 tx, Uint16 ty, Uint32 size, size bytes of writeFrameBlob tile.
+// A batch cut short by a crash fails its checksum and ends the replay.
+// Compaction writes the project file and starts the journal over.
+#define JOURNAL_MAGIC "XFJRNL2"
+#define JOURNAL_BATCH_MAGIC 0x4854414a
+#define JOURNAL_BACKGROUND 0xffffffff
+// journal size at which autosave folds it into the project file
+#define JOURNAL_COMPACT_BYTES (64 << 20)
+
+struct JournalHeader {
+    char magic[8];
+    Uint32 dimx, dimy;
+    Uint32 frames;
+    Uint32 reserved;
+    // stroke log mark of the state the journal starts from
+    Uint64 mark;
+};
+
+class Journal {
+    int _fd;
+    // next write position, only touched by the worker once running
+    Uint64 _end = 0;
+    // bytes appended since the last compaction, as seen from the main thread
+    size_t _size = 0;
+    // of the last batch, unique across sessions
+    Uint64 _mark;
+    // writes reach the file in the order they were made
+    Worker::Serial _writes;
+    struct Pending {
+        Uint32 tiles = 0;
+        std::vector<Uint8> records;
+    };
+    std::map<Uint32, Pending> _frames;
+
+    static void _put(std::vector<Uint8> &out, const void *data, size_t size) {
+        auto bytes = (const Uint8*)data;
+        out.insert(out.end(), bytes, bytes + size);
+    }
+
+    bool _write(const std::vector<Uint8> &data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            auto res = pwrite(_fd, data.data() + done, data.size() - done, _end + done);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                perror("Writing the journal");
+                return false;
+            }
+            done += res;
+        }
+        _end += data.size();
+        return fdatasync(_fd) == 0;
+    }
+
+public:
+    Journal(const std::string &path) : _mark((Uint64)time(nullptr) << 32) {
+        _fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_fd < 0) {
+            perror(path.c_str());
+        }
+    }
+
+    ~Journal() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    bool ok() const {
+        return _fd >= 0;
+    }
+
+    size_t getSize() const {
+        return _size;
+    }
+
+    Uint64 getMark() const {
+        return _mark;
+    }
+
+    // true if a previous run left a journal behind
+    bool recoverable(JournalHeader &header) {
+        struct stat st;
+        if (_fd < 0 || fstat(_fd, &st) < 0 || st.st_size < (off_t)sizeof header) {
+            return false;
+        }
+        return pread(_fd, &header, sizeof header, 0) == sizeof header &&
+               !memcmp(header.magic, JOURNAL_MAGIC, sizeof header.magic);
+    }
+
+    // Applies every intact batch, returns the number of tiles restored.
+    // mark is set to that of the last batch applied.
+    int replay(FrameBuffer &fb, Buffer &background, Uint64 *mark=nullptr) {
+        JournalHeader header;
+        if (!recoverable(header)) {
+            return 0;
+        }
+        if (mark) {
+            *mark = header.mark;
+        }
+        struct stat st;
+        fstat(_fd, &st);
+        std::vector<Uint8> data(st.st_size);
+        if (pread(_fd, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+            perror("Reading the journal");
+            return 0;
+        }
+        auto get = [&data](size_t pos) {
+            Uint32 v;
+            memcpy(&v, data.data() + pos, 4);
+            return v;
+        };
+        // frames are on the canvas' grid too, tiles off it are skipped and
+        // inks clipped like the project loader does
+        auto &canvas = background.getGrid();
+        int tilesx = canvas.getCellTilesX(), tilesy = canvas.getCellTilesY();
+        int res = 0;
+        size_t pos = sizeof header;
+        while (pos + 12 <= data.size()) {
+            size_t size = get(pos + 4);
+            if (get(pos) != JOURNAL_BATCH_MAGIC || size < 8 || pos + 12 + size > data.size() ||
+                    crc32(data.data() + pos + 12, size) != get(pos + 8)) {
+                break;
+            }
+            size_t end = pos + 12 + size;
+            if (mark) {
+                memcpy(mark, data.data() + pos + 12, 8);
+            }
+            pos += 20;
+            while (pos + 24 <= end) {
+                Uint32 frame = get(pos);
+                auto ink = Bounds{(int)get(pos + 4), (int)get(pos + 8), (int)get(pos + 12), (int)get(pos + 16)}
+                    .clipped(canvas.getDimX(), canvas.getDimY());
+                int tiles = get(pos + 20);
+                pos += 24;
+                for (int i = 0; i < tiles && pos + 8 <= end; ++i) {
+                    Uint16 tx, ty;
+                    memcpy(&tx, data.data() + pos, 2);
+                    memcpy(&ty, data.data() + pos + 2, 2);
+                    size_t tile_size = get(pos + 4);
+                    pos += 8;
+                    if (pos + tile_size > end) {
+                        break;
+                    }
+                    auto tile = tile_size ? data.data() + pos : nullptr;
+                    if (tx >= tilesx || ty >= tilesy) {
+                        pos += tile_size;
+                        continue;
+                    }
+                    if (frame == JOURNAL_BACKGROUND) {
+                        background.putTile(tx, ty, tile, tile_size);
+                    } else if ((int)frame < fb.getFrameCapacity()) {
+                        fb.putTile(frame, tx, ty, tile, tile_size, ink);
+                    }
+                    pos += tile_size;
+                    ++res;
+                }
+            }
+            pos = end;
+        }
+        return res;
+    }
+
+    // starts over with an empty journal, on the worker if one is running
+    bool reset(int dimx, int dimy, int frames, Uint64 mark) {
+        JournalHeader header;
+        memset(&header, 0, sizeof header);
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof header.magic);
+        header.dimx = dimx;
+        header.dimy = dimy;
+        header.frames = frames;
+        header.mark = mark;
+        _end = 0;
+        std::vector<Uint8> data;
+        _put(data, &header, sizeof header);
+        return _fd >= 0 && ftruncate(_fd, 0) == 0 && _write(data);
+    }
+
+    // Appends the tiles written since the last checkpoint and marks the
+    // stroke log with the batch. Encoding runs here, writing and syncing
+    // on the worker. False if there was nothing to write.
+    bool checkpoint(FrameBuffer &fb, Buffer &background, Worker &worker, StrokeLog *strokes=nullptr) {
+        if (_fd < 0) {
+            return false;
+        }
+        _frames.clear();
+        auto add = [this](int frame, int tx, int ty, const Uint8 *data, size_t size) {
+            auto &pending = _frames[frame];
+            Uint16 pos[2] = {(Uint16)tx, (Uint16)ty};
+            Uint32 len = size;
+            _put(pending.records, pos, 4);
+            _put(pending.records, &len, 4);
+            _put(pending.records, data, size);
+            ++pending.tiles;
+        };
+        fb.takeUnsaved(add);
+        background.takeUnsaved([&add](int tx, int ty, const Uint8 *data, size_t size) {
+            add(JOURNAL_BACKGROUND, tx, ty, data, size);
+        });
+        if (_frames.empty()) {
+            return false;
+        }
+
+        auto batch = std::make_shared<std::vector<Uint8>>(12);
+        ++_mark;
+        _put(*batch, &_mark, 8);
+        for (auto &it : _frames) {
+            Uint32 frame = it.first;
+            Bounds ink = frame == JOURNAL_BACKGROUND ? background.getInkBounds() : fb.getInkBounds(frame);
+            Sint32 head[4] = {ink.x0, ink.y0, ink.x1, ink.y1};
+            _put(*batch, &frame, 4);
+            _put(*batch, head, 16);
+            _put(*batch, &it.second.tiles, 4);
+            _put(*batch, it.second.records.data(), it.second.records.size());
+        }
+        Uint32 head[3] = {JOURNAL_BATCH_MAGIC, Uint32(batch->size() - 12),
+                          crc32(batch->data() + 12, batch->size() - 12)};
+        memcpy(batch->data(), head, 12);
+        _size += batch->size();
+        if (strokes) {
+            strokes->mark(_mark);
+        }
+        // the mark reaches the disk before the batch does
+        worker.submit([this, batch, strokes] {
+            if (strokes) {
+                strokes->sync();
+            }
+            return _write(*batch);
+        }, Worker::BACKGROUND, nullptr, &_writes);
+        return true;
+    }
+
+    // Folds everything into the project file on the worker and starts the
+    // journal over once that's safely on disk. The journal is kept if
+    // writing the project fails.
+    std::future<bool> compact(const char *path, FrameBuffer &fb, Buffer &background,
+                              int frame_cnt, int frame_rate, int keyframes, Worker &worker,
+                              StrokeLog *strokes=nullptr) {
+        if (!checkpoint(fb, background, worker, strokes) && strokes) {
+            strokes->mark(_mark);
+        }
+        // raw frames are copied here and encoded on the worker
+        auto snapshot = deferSnapshot(fb, background, frame_cnt, frame_rate, keyframes);
+        std::string project = path;
+        int frames = fb.getFrameCapacity();
+        Uint64 mark = _mark;
+        _size = 0;
+        return worker.submit([this, project, snapshot, frames, mark] {
+            auto res = snapshot();
+            return writeProject(project.c_str(), res) && reset(res.dimx, res.dimy, frames, mark);
+        }, Worker::BACKGROUND, nullptr, &_writes);
+    }
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef _LAYOUT_H
+#define _LAYOUT_H
+
+#include <cstdio>
+#include <vector>
+
+#include <GL/glew.h>
+
+
+// How many frames are packed into a single Buffer of the atlas backend
+struct Layout {
+    int framesx, framesy;
+
+    int frames() const {
+        return framesx * framesy;
+    }
+
+    int textures(int total_frames) const {
+        return (total_frames + frames() - 1) / frames();
+    }
+
+    long long bytes(int total_frames, int dimx, int dimy) const {
+        return 4ll * dimx * dimy * frames() * textures(total_frames);
+    }
+};
+
+// near-square packings that fit into max_texture_size
+std::vector<Layout> candidateLayouts(int dimx, int dimy, int total_frames, int max_texture_size) {
+    std::vector<Layout> res;
+    for (int fy = 1; fy <= 8; ++fy) {
+        for (int fx = fy; fx <= fy + 1; ++fx) {
+            Layout layout{fx, fy};
+            if (fx * dimx > max_texture_size || fy * dimy > max_texture_size) {
+                continue;
+            }
+            if (layout.frames() > 1 && layout.frames() > total_frames) {
+                continue;
+            }
+            res.push_back(layout);
+        }
+    }
+    if (res.empty()) {
+        res.push_back(Layout{1, 1});
+    }
+    return res;
+}
+
+// in megabytes, 0 if the driver doesn't tell
+int queryVideoMemory() {
+    GLint kb = 0;
+    if (GLEW_NVX_gpu_memory_info) {
+        glGetIntegerv(GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX, &kb);
+    } else if (GLEW_ATI_meminfo) {
+        GLint info[4] = {0};
+        glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, info);
+        kb = info[0];
+    }
+    return kb / 1024;
+}
+
+// Fewest wasted slots that fit the budget, then fewest textures as long as
+// a single texture stays small enough to be uploaded and paged comfortably.
+Layout chooseLayout(int dimx, int dimy, int total_frames, int max_texture_size, int vram_budget_mb) {
+    const long long max_texture_bytes = 256ll << 20;
+    long long budget = (long long)vram_budget_mb << 20;
+    auto candidates = candidateLayouts(dimx, dimy, total_frames, max_texture_size);
+
+    Layout best = candidates[0];
+    bool found = false;
+    for (auto &layout : candidates) {
+        auto bytes = layout.bytes(total_frames, dimx, dimy);
+        if (layout.frames() > 1 && 4ll * dimx * dimy * layout.frames() > max_texture_bytes) {
+            continue;
+        }
+        if (budget > 0 && bytes > budget) {
+            continue;
+        }
+        auto best_bytes = best.bytes(total_frames, dimx, dimy);
+        if (!found || bytes < best_bytes ||
+                (bytes == best_bytes && layout.textures(total_frames) < best.textures(total_frames))) {
+            best = layout;
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "No atlas layout fits into %d MB of video memory, using %dx%d\n",
+                vram_budget_mb, best.framesx, best.framesy);
+    }
+    return best;
+}
+
+#endif
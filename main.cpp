@@ -1,8 +1,15 @@
 #include "app.h"
 
 
-int main() {
-    App *app = new App();
+int main(int argc, char **argv) {
+    auto opts = parseOptions(argc, argv);
+    if (opts.regress) {
+        return runRegression(opts);
+    }
+    if (opts.headless) {
+        return runBatch(opts);
+    }
+    App *app = new App(opts);
     app->run();
     delete app;
 
@@ -0,0 +1,207 @@
+#ifndef _OPTIONS_H
+#define _OPTIONS_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+struct Options {
+    int frames = 240;
+    // 0x0 picks the atlas layout automatically
+    int framesx = 0, framesy = 0;
+    // in megabytes, 0 asks the driver
+    int vram_budget = 0;
+    bool force_atlas = false;
+    bool bench_layouts = false;
+    bool lock_upload = false;
+    bool sync_upload = false;
+    // seconds a frame has to stay unused before it's compressed, 0 never
+    double pack_after = 10;
+    // in megabytes, 0 is half of the physical memory
+    int memory_budget = 0;
+    const char *scratch_dir = nullptr;
+    // frames playback gets ready ahead of the playhead
+    int lookahead = 8;
+    // composites of played frames are kept at 1/N of the canvas size, 0 off
+    int playback_cache = 0;
+    // playing and scrubbing are drawn from proxies at 1/N of the canvas
+    // size, 1 only when full size can't keep up, 0 never
+    int proxies = 1;
+    const char *project = "untitled.xfb";
+    // frames between keyframes, the ones in between are saved as deltas, 0 none
+    int keyframes = 0;
+    // seconds between journal checkpoints, 0 never
+    double autosave = 5;
+    // replays the stroke log at this speed instead of opening the project, 0 off
+    double timelapse = 0;
+    // numbered images loaded on start, into frames from import_to on or into
+    // the background if import_to is -1
+    const char *import = nullptr;
+    int import_to = 0;
+    // composite every frame into a YUV4MPEG2 file ("-" is stdout) or a GIF and exit
+    const char *export_y4m = nullptr;
+    const char *export_gif = nullptr;
+    bool export_onion = false;
+    // frames trimmed and packed into sheets PREFIX-N.png, with PREFIX.json/csv
+    const char *export_sprites = nullptr;
+    int sheet_size = 4096;
+    // frames with onion skins side by side in one PNG
+    const char *contact_sheet = nullptr;
+    int contact_columns = 8;
+    // no window: runs the imports, edits and exports and exits
+    bool headless = false;
+    bool redraw_strokes = false;
+    int resize_x = 0, resize_y = 0;
+    const char *save_as = nullptr;
+    // stroke logs to replay against golden projects and timings, no window
+    const char *regress = nullptr;
+    bool update_goldens = false;
+    int regress_tolerance = 2;
+    double regress_threshold = 20;
+};
+
+void printUsage(const char *argv0) {
+    printf("Usage: %s [options]\n"
+           "  --frames N          number of frames (default 240)\n"
+           "  --layout WxH        frames per atlas texture, e.g. 4x3, implies --atlas (default: auto)\n"
+           "  --vram-budget MB    video memory the atlas may use (default: ask the driver)\n"
+           "  --atlas             don't use texture arrays even if supported\n"
+           "  --bench-layouts     measure upload and playback speed of atlas layouts and exit\n"
+           "  --lock-upload       upload through locked streaming textures (keeps a second copy of every frame)\n"
+           "  --sync-upload       upload straight from memory instead of through pixel buffer objects\n"
+           "  --pack-after S      compress frames unused for S seconds, 0 never (default 10)\n"
+           "  --memory-budget MB  memory frames may use before they're spilled to disk (default: half of RAM)\n"
+           "  --scratch-dir DIR   where spilled frames go (default: $TMPDIR or /tmp)\n"
+           "  --lookahead N       frames playback decodes and uploads ahead (default 8)\n"
+           "  --playback-cache R  keep composites of played frames at full, half or quarter resolution (default off)\n"
+           "  --proxies R         play and scrub from half or quarter resolution proxies, auto or off (default auto)\n"
+           "  --project FILE      project to open if it exists and to save to (default untitled.xfb)\n"
+           "  --keyframes N       save frames as deltas against every Nth frame, 0 never (default 0)\n"
+           "  --autosave S        journal changes every S seconds, 0 never (default 5)\n"
+           "  --timelapse SPEED   replay every stroke drawn on the project at SPEED times the pace\n"
+           "  --import PATTERN    load a PNG/PPM sequence like ref/%%04d.png into frames\n"
+           "  --import-to N|bg    first frame to import into, or the background (default 0)\n"
+           "  --export-y4m FILE   write the animation as YUV4MPEG2 to FILE, or - for stdout, and exit\n"
+           "  --export-gif FILE   write the animation as a looping GIF and exit\n"
+           "  --export-onion      include the onion skins in the export\n"
+           "  --export-sprites P  write frames trimmed to their ink as P-N.png sprite sheets and P.json/P.csv, and exit\n"
+           "  --sheet-size N      largest sprite sheet side, a power of two (default 4096)\n"
+           "  --contact-sheet F   write every frame with its onion skins into one PNG and exit\n"
+           "  --contact-columns N frames per row of the contact sheet (default 8)\n"
+           "  --headless          work on the project without a display, then exit; needed for:\n"
+           "  --redraw-strokes    clear the project and draw every stroke in its log again\n"
+           "  --resize WxH        fit the project into a WxH canvas\n"
+           "  --save-as FILE      where a headless run saves the project (default: over it, if it changed)\n"
+           "  --regress DIR       replay DIR/*.strokes without a display, compare with the golden DIR/*.xfb and\n"
+           "                      the timings in DIR/baseline.txt, exit 1 on any difference or slowdown\n"
+           "  --update-goldens    write the golden projects and timings instead of comparing with them\n"
+           "  --regress-tolerance N   channel difference a pixel may have (default 2)\n"
+           "  --regress-threshold PCT percent a timing may be slower than its baseline (default 20)\n",
+           argv0);
+}
+
+Options parseOptions(int argc, char **argv) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (!strcmp(arg, "--frames") && has_value) {
+            opts.frames = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--layout") && has_value) {
+            auto value = argv[++i];
+            if (strcmp(value, "auto") && sscanf(value, "%dx%d", &opts.framesx, &opts.framesy) != 2) {
+                opts.framesx = -1;
+            }
+        } else if (!strcmp(arg, "--vram-budget") && has_value) {
+            opts.vram_budget = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--atlas")) {
+            opts.force_atlas = true;
+        } else if (!strcmp(arg, "--bench-layouts")) {
+            opts.bench_layouts = true;
+        } else if (!strcmp(arg, "--lock-upload")) {
+            opts.lock_upload = true;
+        } else if (!strcmp(arg, "--sync-upload")) {
+            opts.sync_upload = true;
+        } else if (!strcmp(arg, "--pack-after") && has_value) {
+            opts.pack_after = atof(argv[++i]);
+        } else if (!strcmp(arg, "--memory-budget") && has_value) {
+            opts.memory_budget = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--scratch-dir") && has_value) {
+            opts.scratch_dir = argv[++i];
+        } else if (!strcmp(arg, "--lookahead") && has_value) {
+            opts.lookahead = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--playback-cache") && has_value) {
+            auto value = argv[++i];
+            opts.playback_cache = !strcmp(value, "full") ? 1 : !strcmp(value, "half") ? 2 :
+                                  !strcmp(value, "quarter") ? 4 : !strcmp(value, "off") ? 0 : -1;
+        } else if (!strcmp(arg, "--proxies") && has_value) {
+            auto value = argv[++i];
+            opts.proxies = !strcmp(value, "auto") ? 1 : !strcmp(value, "half") ? 2 :
+                           !strcmp(value, "quarter") ? 4 : !strcmp(value, "off") ? 0 : -1;
+        } else if (!strcmp(arg, "--project") && has_value) {
+            opts.project = argv[++i];
+        } else if (!strcmp(arg, "--keyframes") && has_value) {
+            opts.keyframes = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--autosave") && has_value) {
+            opts.autosave = atof(argv[++i]);
+        } else if (!strcmp(arg, "--import") && has_value) {
+            opts.import = argv[++i];
+        } else if (!strcmp(arg, "--import-to") && has_value) {
+            auto value = argv[++i];
+            opts.import_to = strcmp(value, "bg") ? atoi(value) : -1;
+        } else if (!strcmp(arg, "--export-y4m") && has_value) {
+            opts.export_y4m = argv[++i];
+        } else if (!strcmp(arg, "--export-gif") && has_value) {
+            opts.export_gif = argv[++i];
+        } else if (!strcmp(arg, "--export-sprites") && has_value) {
+            opts.export_sprites = argv[++i];
+        } else if (!strcmp(arg, "--sheet-size") && has_value) {
+            opts.sheet_size = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--contact-sheet") && has_value) {
+            opts.contact_sheet = argv[++i];
+        } else if (!strcmp(arg, "--contact-columns") && has_value) {
+            opts.contact_columns = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--headless")) {
+            opts.headless = true;
+        } else if (!strcmp(arg, "--redraw-strokes")) {
+            opts.redraw_strokes = true;
+        } else if (!strcmp(arg, "--resize") && has_value) {
+            if (sscanf(argv[++i], "%dx%d", &opts.resize_x, &opts.resize_y) != 2 || opts.resize_x < 1 ||
+                    opts.resize_y < 1) {
+                opts.resize_x = -1;
+            }
+        } else if (!strcmp(arg, "--save-as") && has_value) {
+            opts.save_as = argv[++i];
+        } else if (!strcmp(arg, "--regress") && has_value) {
+            opts.regress = argv[++i];
+        } else if (!strcmp(arg, "--update-goldens")) {
+            opts.update_goldens = true;
+        } else if (!strcmp(arg, "--regress-tolerance") && has_value) {
+            opts.regress_tolerance = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--regress-threshold") && has_value) {
+            opts.regress_threshold = atof(argv[++i]);
+        } else if (!strcmp(arg, "--export-onion")) {
+            opts.export_onion = true;
+        } else if (!strcmp(arg, "--timelapse") && has_value) {
+            opts.timelapse = atof(argv[++i]);
+        } else {
+            printUsage(argv[0]);
+            exit(strcmp(arg, "--help") ? 1 : 0);
+        }
+    }
+    if (opts.frames < 1 || opts.framesx < 0 || opts.framesy < 0 || opts.vram_budget < 0 || opts.pack_after < 0 ||
+            opts.memory_budget < 0 || opts.lookahead < 0 || opts.playback_cache < 0 || opts.proxies < 0 || opts.keyframes < 0 || opts.autosave < 0 || opts.timelapse < 0 ||
+            opts.import_to < -1 || opts.sheet_size < 1 || (opts.sheet_size & (opts.sheet_size - 1)) ||
+            opts.contact_columns < 1 || opts.resize_x < 0 || opts.regress_tolerance < 0 || opts.regress_threshold < 0 ||
+            (!opts.headless && (opts.redraw_strokes || opts.resize_x || opts.save_as))) {
+        printUsage(argv[0]);
+        exit(1);
+    }
+    if (!opts.scratch_dir) {
+        opts.scratch_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    }
+    return opts;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef _PBO_H
+#define _PBO_H
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <GL/glew.h>
+
+
+// Ring of pixel buffer objects for texture uploads. Dirty rects are copied
+// into a buffer the GPU is done with (checked with a fence, never waited
+// on) and the texture update is sourced from it, so the driver doesn't
+// have to stall until the previous frame stops using the texture. Once a
+// buffer can't be mapped the ring is done for, see failed().
+class UploadRing {
+    struct Slot {
+        GLuint pbo = 0;
+        size_t capacity = 0;
+        GLsync fence = nullptr;
+    };
+
+    std::vector<Slot> _slots;
+    int _next = 0;
+    int _staged = -1;
+    bool _failed = false;
+
+    bool _free(Slot &slot) {
+        if (!slot.fence) {
+            return true;
+        }
+        auto res = glClientWaitSync(slot.fence, 0, 0);
+        if (res == GL_ALREADY_SIGNALED || res == GL_CONDITION_SATISFIED) {
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+            return true;
+        }
+        return false;
+    }
+
+public:
+    int stalls = 0;
+
+    UploadRing(int size=3) : _slots(size) {
+        for (auto &slot : _slots) {
+            glGenBuffers(1, &slot.pbo);
+        }
+    }
+
+    ~UploadRing() {
+        for (auto &slot : _slots) {
+            if (slot.fence) {
+                glDeleteSync(slot.fence);
+            }
+            glDeleteBuffers(1, &slot.pbo);
+        }
+    }
+
+    static bool supported() {
+        return GLEW_VERSION_3_2 || (GLEW_ARB_pixel_buffer_object && GLEW_ARB_sync && GLEW_ARB_map_buffer_range);
+    }
+
+    // true once a buffer couldn't be mapped, uploads go straight from
+    // client memory from then on
+    bool failed() const {
+        return _failed;
+    }
+
+    // Packs the rects of pixels tightly into a free buffer and leaves it
+    // bound to GL_PIXEL_UNPACK_BUFFER, offsets[i] is where rects[i] starts.
+    // Returns false if every buffer is still in use by the GPU, or if the
+    // ring failed.
+    bool stage(const Uint8 *pixels, int pitch, const std::vector<SDL_Rect> &rects,
+               std::vector<size_t> &offsets) {
+        if (_failed) {
+            return false;
+        }
+        size_t bytes = 0;
+        offsets.clear();
+        for (auto &rect : rects) {
+            offsets.push_back(bytes);
+            bytes += 4ull * rect.w * rect.h;
+        }
+        if (!bytes) {
+            return false;
+        }
+
+        int idx = -1;
+        for (size_t i = 0; i < _slots.size(); ++i) {
+            int candidate = (_next + i) % _slots.size();
+            if (_free(_slots[candidate])) {
+                idx = candidate;
+                break;
+            }
+        }
+        if (idx < 0) {
+            ++stalls;
+            return false;
+        }
+        auto &slot = _slots[idx];
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+        if (slot.capacity < bytes) {
+            slot.capacity = bytes + bytes / 2;
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, slot.capacity, nullptr, GL_STREAM_DRAW);
+        }
+        auto dst = (Uint8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (!dst) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            fprintf(stderr, "Can't map a pixel buffer, uploading textures without them\n");
+            _failed = true;
+            return false;
+        }
+        for (size_t i = 0; i < rects.size(); ++i) {
+            auto &rect = rects[i];
+            auto src = pixels + rect.y * pitch + 4 * rect.x;
+            for (int y = 0; y < rect.h; ++y) {
+                memcpy(dst + offsets[i] + 4ull * y * rect.w, src + y * pitch, 4 * rect.w);
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        _staged = idx;
+        _next = (idx + 1) % _slots.size();
+        return true;
+    }
+
+    // call once the texture updates reading from the staged buffer are issued
+    void submit() {
+        if (_staged < 0) {
+            return;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        _slots[_staged].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        _staged = -1;
+    }
+};
+
+#endif
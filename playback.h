@@ -0,0 +1,353 @@
+#ifndef _PLAYBACK_H
+#define _PLAYBACK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+#include "framebuffer.h"
+#include "proxy.h"
+#include "worker.h"
+
+
+// frames uploaded per tick at most, each may be a whole atlas texture
+#define PLAYBACK_UPLOADS 2
+// late ticks in a row after which playback drops to the next proxy level
+#define PLAYBACK_BEHIND 4
+
+// Keeps the frames about to be drawn ready: those along the path
+// playback or scrubbing will take, with their onion skins, are read
+// back, decoded on the worker and uploaded a few per tick, nearest
+// first. Textures playback reaches last are dropped to stay within the
+// video memory budget. When ticks keep running late, playback goes down
+// a proxy level until it stops.
+class Playback {
+public:
+    struct Health {
+        // frames looked ahead, and of those ready in a row from the playhead
+        int window = 0, ready = 0;
+        // frames of the window still being read back, decoded or uploaded
+        int pending = 0;
+        // frames that weren't ready when drawn, ticks longer than a frame,
+        // ticks drawn from proxies
+        size_t stalls = 0, late = 0, proxied = 0;
+    };
+
+private:
+    size_t _texture_budget;
+    std::vector<int> _frames, _shown;
+    Health _health;
+    // proxy level playback is drawn at, 0 for full size
+    int _level = 0, _late_run = 0;
+
+    // the frame and its onion skins
+    void _addShown(std::vector<int> &frames, int frame, int frame_cnt, int onion_prev, int onion_next) {
+        auto add = [&](int f) {
+            f = (f % frame_cnt + frame_cnt) % frame_cnt;
+            if (std::find(frames.begin(), frames.end(), f) == frames.end()) {
+                frames.push_back(f);
+            }
+        };
+        add(frame);
+        for (int i = 1; i <= std::max(onion_prev, onion_next); ++i) {
+            if (i <= onion_prev) {
+                add(frame - i);
+            }
+            if (i <= onion_next) {
+                add(frame + i);
+            }
+        }
+    }
+
+    bool _ready(FrameBuffer &fb, const std::vector<int> &frames) {
+        return std::all_of(frames.begin(), frames.end(), [&](int f) { return fb.isReady(f); });
+    }
+
+public:
+    // texture_budget in bytes, 0 keeps every texture
+    Playback(size_t texture_budget) : _texture_budget(texture_budget) {
+    }
+
+    const Health &getHealth() const {
+        return _health;
+    }
+
+    // call before drawing frame, counts a stall if it isn't ready
+    void draw(FrameBuffer &fb, int frame, int frame_cnt, int onion_prev, int onion_next) {
+        _shown.clear();
+        _addShown(_shown, frame, frame_cnt, onion_prev, onion_next);
+        _health.stalls += !_ready(fb, _shown);
+    }
+
+    // call after every tick of playback, level being the proxy level the
+    // frame was drawn at
+    void tick(bool late, int level) {
+        _health.late += late;
+        _health.proxied += level > 0;
+        if (level != _level) {
+            return;
+        }
+        _late_run = late ? _late_run + 1 : 0;
+        if (_late_run >= PLAYBACK_BEHIND && _level < PROXY_LEVELS) {
+            ++_level;
+            _late_run = 0;
+        }
+    }
+
+    // back to full size, call while not playing
+    void stop() {
+        _level = _late_run = 0;
+    }
+
+    int getLevel() const {
+        return _level;
+    }
+
+    // true if frame and its onion skins can be drawn right away
+    bool ready(FrameBuffer &fb, int frame, int frame_cnt, int onion_prev, int onion_next) {
+        _shown.clear();
+        _addShown(_shown, frame, frame_cnt, onion_prev, onion_next);
+        return _ready(fb, _shown);
+    }
+
+    // Prepares the frames drawn for every frame of path, the first one
+    // being drawn now. Frames for which cached(frame) is true are drawn
+    // some other way and skipped. Call once per tick.
+    template<typename F>
+    void update(FrameBuffer &fb, Worker &worker, const std::vector<int> &path, int frame_cnt, int onion_prev,
+                int onion_next, F cached) {
+        _frames.clear();
+        for (int frame : path) {
+            if (!cached(frame)) {
+                _addShown(_frames, frame, frame_cnt, onion_prev, onion_next);
+            }
+        }
+        fb.prefetch(worker, _frames);
+        fb.upload(_frames, PLAYBACK_UPLOADS);
+        fb.limitTextures(_texture_budget, _frames, path[0], frame_cnt);
+
+        _health.window = path.size() - 1;
+        _health.ready = 0;
+        for (int k = 1; k < (int)path.size(); ++k) {
+            if (!cached(path[k]) && !ready(fb, path[k], frame_cnt, onion_prev, onion_next)) {
+                break;
+            }
+            _health.ready = k;
+        }
+        _health.pending = std::count_if(_frames.begin(), _frames.end(), [&](int f) { return !fb.isReady(f); });
+    }
+};
+
+// scrubbing has stopped once the frame stays put this long, in seconds
+#define SCRUB_IDLE 0.25
+// how far ahead scrubbing is predicted, in seconds
+#define SCRUB_HORIZON 0.5
+
+// Follows how fast and which way the current frame is moved by hand,
+// with the slider or the arrow keys, to guess the frames coming next
+class ScrubPredictor {
+    typedef std::chrono::steady_clock Clock;
+
+    int _frame = -1;
+    // in frames per second
+    double _velocity = 0;
+    Clock::time_point _moved;
+
+    double _idle() const {
+        return std::chrono::duration<double>(Clock::now() - _moved).count();
+    }
+
+public:
+    // call once per tick with the current frame
+    void update(int frame, int frame_cnt) {
+        if (_frame < 0 || _frame >= frame_cnt) {
+            _frame = frame;
+            _moved = Clock::now();
+            return;
+        }
+        if (frame == _frame) {
+            if (_idle() >= SCRUB_IDLE) {
+                _velocity = 0;
+            }
+            return;
+        }
+        // the shorter way around the loop
+        int delta = frame - _frame;
+        if (2 * abs(delta) > frame_cnt) {
+            delta -= delta > 0 ? frame_cnt : -frame_cnt;
+        }
+        // the first move after a pause counts as if it came right after it
+        double velocity = delta / std::max(std::min(_idle(), SCRUB_IDLE), 1e-3);
+        bool turned = (velocity > 0) != (_velocity > 0);
+        _velocity = _velocity == 0 || turned ? velocity : (_velocity + velocity) / 2;
+        _frame = frame;
+        _moved = Clock::now();
+    }
+
+    // forgets where the frame was, e.g. while playback moves it
+    void stop() {
+        _frame = -1;
+        _velocity = 0;
+    }
+
+    bool scrubbing() const {
+        return _velocity != 0 && _idle() < SCRUB_IDLE;
+    }
+
+    double getVelocity() const {
+        return scrubbing() ? _velocity : 0;
+    }
+
+    // Appends up to count frames scrubbing is expected to land on after
+    // frame, evenly spread over the next SCRUB_HORIZON seconds
+    void predict(int frame, int frame_cnt, int count, std::vector<int> &path) const {
+        double span = getVelocity() * SCRUB_HORIZON;
+        if (span == 0 || count < 1) {
+            return;
+        }
+        // at most halfway around the loop
+        span = std::max(1., std::min(fabs(span), frame_cnt / 2.)) * (span > 0 ? 1 : -1);
+        int steps = std::min<int>(count, ceil(fabs(span)));
+        for (int k = 1; k <= steps; ++k) {
+            int f = ((frame + (int)lround(span * k / steps)) % frame_cnt + frame_cnt) % frame_cnt;
+            if (std::find(path.begin(), path.end(), f) == path.end()) {
+                path.push_back(f);
+            }
+        }
+    }
+};
+
+// share of the video memory budget the composite cache takes, 1/N
+#define PLAYBACK_CACHE_SHARE 4
+
+// Final composites of frames at 1/scale of the canvas size, so that a
+// frame shown once is a single blit every time playback comes around to
+// it again. An entry is only used with the key it was baked with, which
+// the caller derives from whatever went into the composite. Past the
+// budget, the entries drawn longest ago are dropped.
+class CompositeCache {
+    typedef std::chrono::steady_clock Clock;
+
+    SDL_Renderer *_renderer;
+    int _dimx, _dimy, _scale;
+    size_t _budget, _bytes = 0;
+    std::vector<SDL_Texture*> _textures;
+    // 0 if nothing was baked
+    std::vector<Uint64> _keys;
+    std::vector<Clock::time_point> _drawn;
+    // full size, reduced caches are drawn into it first
+    SDL_Texture *_scratch = nullptr;
+
+    size_t _entryBytes() const {
+        return 4ull * (_dimx / _scale) * (_dimy / _scale);
+    }
+
+    // drops the entries drawn longest ago, but never keep
+    void _limitTextures(int keep) {
+        while (_budget && _bytes > _budget) {
+            int oldest = -1;
+            for (int f = 0; f < (int)_textures.size(); ++f) {
+                if (_textures[f] && f != keep && (oldest < 0 || _drawn[f] < _drawn[oldest])) {
+                    oldest = f;
+                }
+            }
+            if (oldest < 0) {
+                return;
+            }
+            SDL_DestroyTexture(_textures[oldest]);
+            _textures[oldest] = nullptr;
+            _keys[oldest] = 0;
+            _bytes -= _entryBytes();
+        }
+    }
+
+    // filtered when scaled, opaque when drawn
+    SDL_Texture *_createTarget(int w, int h) {
+        auto res = createScaledTexture(_renderer, SDL_TEXTUREACCESS_TARGET, w, h);
+        if (res) {
+            SDL_SetTextureBlendMode(res, SDL_BLENDMODE_NONE);
+        }
+        return res;
+    }
+
+public:
+    // budget in bytes, 0 keeps every entry
+    CompositeCache(SDL_Renderer *renderer, int dimx, int dimy, int frames, int scale, size_t budget) :
+        _renderer(renderer), _dimx(dimx), _dimy(dimy), _scale(scale), _budget(budget), _textures(frames),
+        _keys(frames), _drawn(frames)
+    {
+    }
+
+    ~CompositeCache() {
+        for (auto texture : _textures) {
+            if (texture) {
+                SDL_DestroyTexture(texture);
+            }
+        }
+        if (_scratch) {
+            SDL_DestroyTexture(_scratch);
+        }
+    }
+
+    static bool supported(SDL_Renderer *renderer) {
+        return SDL_RenderTargetSupported(renderer);
+    }
+
+    bool has(int frame, Uint64 key) const {
+        return _keys[frame] && _keys[frame] == key;
+    }
+
+    // Draws the composite of frame over the whole viewport, false if it
+    // isn't baked with key
+    bool draw(int frame, Uint64 key) {
+        if (!has(frame, key)) {
+            return false;
+        }
+        SDL_RenderCopy(_renderer, _textures[frame], nullptr, nullptr);
+        _drawn[frame] = Clock::now();
+        return true;
+    }
+
+    // Bakes the composite of frame with key, draw(true) renders it into
+    // the current render target. Returns false if no target could be made.
+    template<typename F>
+    bool bake(int frame, Uint64 key, F draw) {
+        auto &texture = _textures[frame];
+        if (!texture) {
+            texture = _createTarget(_dimx / _scale, _dimy / _scale);
+            _bytes += texture ? _entryBytes() : 0;
+        }
+        if (_scale > 1 && !_scratch) {
+            _scratch = _createTarget(_dimx, _dimy);
+            _bytes += _scratch ? 4ull * _dimx * _dimy : 0;
+        }
+        _drawn[frame] = Clock::now();
+        _limitTextures(frame);
+        if (!texture || (_scale > 1 && !_scratch)) {
+            return false;
+        }
+        SDL_SetRenderTarget(_renderer, _scale > 1 ? _scratch : texture);
+        SDL_RenderClear(_renderer);
+        draw(true);
+        if (_scale > 1) {
+            SDL_SetRenderTarget(_renderer, texture);
+            SDL_RenderCopy(_renderer, _scratch, nullptr, nullptr);
+        }
+        SDL_SetRenderTarget(_renderer, nullptr);
+        _keys[frame] = key;
+        return true;
+    }
+
+    int getBakedCount() const {
+        return std::count_if(_keys.begin(), _keys.end(), [](Uint64 key) { return key != 0; });
+    }
+
+    size_t getBytes() const {
+        return _bytes;
+    }
+};
+
+#endif
@@ -0,0 +1,472 @@
+#ifndef _PROJECT_H
+#define _PROJECT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <SDL2/SDL.h>
+
+#include "bounds.h"
+#include "buffer.h"
+#include "codec.h"
+#include "framebuffer.h"
+#include "worker.h"
+
+
+// A read-only mapping of a whole file. Tiles loaded from a project point
+// into it and keep it alive, so the kernel faults frames in as they're
+// looked at and drops them again under memory pressure.
+class MappedFile {
+    int _fd = -1;
+    const Uint8 *_data = nullptr;
+    size_t _size = 0;
+
+public:
+    ~MappedFile() {
+        if (_data) {
+            munmap((void*)_data, _size);
+        }
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    static std::shared_ptr<MappedFile> open(const char *path) {
+        auto res = std::make_shared<MappedFile>();
+        res->_fd = ::open(path, O_RDONLY);
+        struct stat st;
+        if (res->_fd < 0 || fstat(res->_fd, &st) < 0 || st.st_size == 0) {
+            return nullptr;
+        }
+        res->_size = st.st_size;
+        auto data = mmap(nullptr, res->_size, PROT_READ, MAP_PRIVATE, res->_fd, 0);
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+        res->_data = (const Uint8*)data;
+        // frames are visited in any order, don't read ahead of them
+        madvise(data, res->_size, MADV_RANDOM);
+        return res;
+    }
+
+    const Uint8 *data() const {
+        return _data;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+};
+
+// Project files start with a ProjectHeader, a ProjectEntry per frame,
+// the background last, and a ProjectTile per tile used by more than one
+// frame. Then come those tiles and the frames in the format of
+// writeFrameBlob, each frame starting on a page boundary so it can be
+// faulted in on its own. Blank frames take no space. With keyframes set,
+// every frame in between may store tiles as deltas against the last
+// keyframe. Version 1 files have no shared tiles, versions before 3 no
+// keyframes and a shorter header.
+#define PROJECT_MAGIC "XFLIPBK"
+#define PROJECT_VERSION 3
+#define PROJECT_PAGE 4096
+
+// canvases with a longer side are taken for a damaged header
+#define PROJECT_MAX_SIDE 65536
+
+struct ProjectHeader {
+    char magic[8];
+    Uint32 version;
+    Uint32 dimx, dimy;
+    Uint32 frames;
+    Uint32 tile_size;
+    Uint32 frame_cnt, frame_rate;
+    Uint32 shared_tiles;
+    Uint32 keyframes;
+    Uint32 reserved;
+};
+
+size_t projectHeaderSize(Uint32 version) {
+    return version < 3 ? offsetof(ProjectHeader, keyframes) : sizeof(ProjectHeader);
+}
+
+struct ProjectEntry {
+    Uint64 offset, size;
+    Sint32 x0, y0, x1, y1;
+};
+
+struct ProjectTile {
+    Uint64 offset;
+    Uint32 size;
+    Uint32 reserved;
+};
+
+class Project {
+    std::shared_ptr<MappedFile> _file;
+    ProjectHeader _header;
+    size_t _entries;
+    std::vector<TileRef> _shared;
+
+    bool _readFrame(int frame, PackedFrame &tiles, Bounds &ink, std::vector<bool> *delta) const {
+        ProjectEntry entry;
+        memcpy(&entry, _file->data() + _entries + frame * sizeof entry, sizeof entry);
+        tiles = PackedFrame{};
+        ink = Bounds{};
+        if (!entry.size) {
+            return true;
+        }
+        // it's rescanned on the next erase, so it had better be on the canvas
+        ink = Bounds{entry.x0, entry.y0, entry.x1, entry.y1}.clipped(_header.dimx, _header.dimy);
+        // the tiles of every frame are on the grid of the canvas
+        TileGrid grid(_header.dimx, _header.dimy);
+        auto size = _file->size();
+        if (entry.size > size || entry.offset > size - entry.size ||
+                !readFrameBlob(_file->data() + entry.offset, entry.size, _file, true, tiles, &_shared, delta) ||
+                (!tiles.empty() && (tiles.tilesx != grid.getTilesX() || tiles.tilesy != grid.getTilesY()))) {
+            fprintf(stderr, "Frame %d of the project is damaged\n", frame);
+            tiles = PackedFrame{};
+            ink = Bounds{};
+            return false;
+        }
+        return true;
+    }
+
+public:
+    // prints what's wrong if the file isn't a project we can open
+    bool open(const char *path) {
+        _file = MappedFile::open(path);
+        if (!_file) {
+            perror(path);
+            return false;
+        }
+        memset(&_header, 0, sizeof _header);
+        memcpy(&_header, _file->data(), std::min(sizeof _header, _file->size()));
+        if (_file->size() < projectHeaderSize(1) || memcmp(_header.magic, PROJECT_MAGIC, sizeof _header.magic) ||
+                !_header.version || _header.version > PROJECT_VERSION) {
+            fprintf(stderr, "%s: not a project file or from a newer version\n", path);
+            return false;
+        }
+        _entries = projectHeaderSize(_header.version);
+        if (_header.version < 3) {
+            _header.keyframes = 0;
+        }
+        if (_header.version < 2) {
+            _header.shared_tiles = 0;
+        }
+        size_t table = _entries + (_header.frames + 1ull) * sizeof(ProjectEntry);
+        if (_header.tile_size != TILE_SIZE || !_header.frames || !_header.dimx || !_header.dimy ||
+                _header.dimx > PROJECT_MAX_SIDE || _header.dimy > PROJECT_MAX_SIDE ||
+                table + (Uint64)_header.shared_tiles * sizeof(ProjectTile) > _file->size()) {
+            fprintf(stderr, "%s: damaged project file\n", path);
+            return false;
+        }
+        _shared.clear();
+        for (Uint32 i = 0; i < _header.shared_tiles; ++i) {
+            ProjectTile entry;
+            memcpy(&entry, _file->data() + table + i * sizeof entry, sizeof entry);
+            if (!entry.size || entry.size > _file->size() || entry.offset > _file->size() - entry.size) {
+                fprintf(stderr, "%s: damaged project file\n", path);
+                return false;
+            }
+            auto tile = std::make_shared<PackedTile>();
+            tile->data = _file->data() + entry.offset;
+            tile->size = entry.size;
+            tile->keep = _file;
+            tile->mapped = true;
+            _shared.push_back(TileCache::get().intern(tile));
+        }
+        return true;
+    }
+
+    int getDimX() const {
+        return _header.dimx;
+    }
+
+    int getDimY() const {
+        return _header.dimy;
+    }
+
+    int getFrames() const {
+        return _header.frames;
+    }
+
+    int getFrameCount() const {
+        return _header.frame_cnt;
+    }
+
+    int getFrameRate() const {
+        return _header.frame_rate;
+    }
+
+    int getKeyframes() const {
+        return _header.keyframes;
+    }
+
+    // Tiles point into the mapping, nothing is read yet, except for tiles
+    // stored as deltas: those are decoded against their keyframe. Frame
+    // getFrames() is the background.
+    bool getFrame(int frame, PackedFrame &tiles, Bounds &ink) const {
+        std::vector<bool> delta;
+        if (!_readFrame(frame, tiles, ink, &delta)) {
+            return false;
+        }
+        if (delta.empty()) {
+            return true;
+        }
+        int key = _header.keyframes && frame < (int)_header.frames ? frame - frame % _header.keyframes : frame;
+        PackedFrame key_tiles;
+        Bounds key_ink;
+        // deltas are against the tile at the same index of the keyframe
+        if (key == frame || !_readFrame(key, key_tiles, key_ink, nullptr) || delta.size() != tiles.tiles.size() ||
+                (!key_tiles.empty() && (key_tiles.tilesx != tiles.tilesx || key_tiles.tilesy != tiles.tilesy ||
+                                        key_tiles.tiles.size() != tiles.tiles.size()))) {
+            fprintf(stderr, "Frame %d of the project is damaged\n", frame);
+            tiles = PackedFrame{};
+            ink = Bounds{};
+            return false;
+        }
+        TileGrid grid(_header.dimx, _header.dimy);
+        std::vector<Uint8> data;
+        for (int ty = 0; ty < tiles.tilesy; ++ty) {
+            for (int tx = 0; tx < tiles.tilesx; ++tx) {
+                int i = tx + ty * tiles.tilesx;
+                if (!delta[i]) {
+                    continue;
+                }
+                auto &tile = tiles.tiles[i];
+                auto rect = grid.tileRect(tx, ty);
+                xorTiles(key_tiles.empty() ? nullptr : key_tiles.tiles[i].get(), tile.get(), rect.w, rect.h, data);
+                tiles.bytes += data.size();
+                tiles.bytes -= tile->size;
+                tiles.mapped -= tile->size;
+                tile = data.empty() ? nullptr : TileCache::get().intern(makeTile(data));
+            }
+        }
+        return true;
+    }
+};
+
+void loadProject(const Project &project, FrameBuffer &fb, Buffer &background, Worker &worker) {
+    // keyframe groups decode independently of each other
+    int frames = project.getFrames(), group = project.getKeyframes();
+    std::vector<PackedFrame> decoded(group ? frames : 0);
+    std::vector<Bounds> inks(decoded.size());
+    if (group) {
+        worker.parallelFor((frames + group - 1) / group, [&](int g) {
+            for (int frame = g * group; frame < std::min(frames, (g + 1) * group); ++frame) {
+                project.getFrame(frame, decoded[frame], inks[frame]);
+            }
+        });
+    }
+    fb.loadFrames([&](int frame, PackedFrame &tiles, Bounds &ink) {
+        if (frame < frames && group) {
+            tiles = std::move(decoded[frame]);
+            ink = inks[frame];
+        } else if (frame < frames) {
+            project.getFrame(frame, tiles, ink);
+        }
+    });
+    PackedFrame tiles;
+    Bounds ink;
+    project.getFrame(project.getFrames(), tiles, ink);
+    background.setPacked(tiles, ink);
+}
+
+// Everything a project file holds. The tiles are shared with the buffers
+// and never change, so the snapshot can be written on another thread
+// while drawing goes on.
+struct ProjectSnapshot {
+    int dimx, dimy;
+    int frame_cnt, frame_rate;
+    // frames between keyframes are saved as deltas, 0 none
+    int keyframes;
+    // the background last
+    std::vector<PackedFrame> frames;
+    std::vector<Bounds> inks;
+    // some frames were lost from the scratch file, saving it would
+    // overwrite them with blank ones
+    bool damaged = false;
+};
+
+ProjectSnapshot snapshotProject(FrameBuffer &fb, Buffer &background, int frame_cnt, int frame_rate,
+                                int keyframes=0) {
+    ProjectSnapshot res;
+    auto &grid = background.getGrid();
+    res.dimx = grid.getDimX();
+    res.dimy = grid.getDimY();
+    res.frame_cnt = frame_cnt;
+    res.frame_rate = frame_rate;
+    res.keyframes = keyframes;
+    res.frames.reserve(fb.getFrameCapacity() + 1);
+    fb.saveFrames([&res](int frame, const PackedFrame &tiles, const Bounds &ink) {
+        res.frames.push_back(tiles);
+        res.inks.push_back(ink);
+    });
+    res.frames.push_back(background.getPacked());
+    res.inks.push_back(background.getInkBounds());
+    res.damaged = fb.isDamaged() || background.isDamaged();
+    return res;
+}
+
+// snapshotProject in two halves: what goes into the snapshot is taken
+// from the frames now, the returned function makes it on any thread.
+// Raw frames are encoded there instead of here.
+std::function<ProjectSnapshot()> deferSnapshot(FrameBuffer &fb, Buffer &background, int frame_cnt,
+                                               int frame_rate, int keyframes=0) {
+    ProjectSnapshot res;
+    auto &grid = background.getGrid();
+    res.dimx = grid.getDimX();
+    res.dimy = grid.getDimY();
+    res.frame_cnt = frame_cnt;
+    res.frame_rate = frame_rate;
+    res.keyframes = keyframes;
+    auto frames = fb.deferFrames();
+    auto background_tiles = background.deferPacked();
+    auto background_ink = background.getInkBounds();
+    res.damaged = fb.isDamaged() || background.isDamaged();
+    return [res, frames, background_tiles, background_ink]() {
+        auto snapshot = res;
+        frames(snapshot.frames, snapshot.inks);
+        snapshot.frames.push_back(background_tiles());
+        snapshot.inks.push_back(background_ink);
+        return snapshot;
+    };
+}
+
+// Writes next to path and renames over it once everything is on disk, a
+// project still mapped from path keeps reading the old file.
+bool writeProject(const char *path, const ProjectSnapshot &snapshot) {
+    if (snapshot.damaged) {
+        fprintf(stderr, "%s: not saved, frames couldn't be read back from the scratch file\n", path);
+        return false;
+    }
+    auto tmp = std::string(path) + ".tmp";
+    auto file = fopen(tmp.c_str(), "wb");
+    if (!file) {
+        perror(tmp.c_str());
+        return false;
+    }
+    ProjectHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, PROJECT_MAGIC, sizeof header.magic);
+    header.version = PROJECT_VERSION;
+    header.dimx = snapshot.dimx;
+    header.dimy = snapshot.dimy;
+    header.frames = snapshot.frames.size() - 1;
+    header.tile_size = TILE_SIZE;
+    header.frame_cnt = snapshot.frame_cnt;
+    header.frame_rate = snapshot.frame_rate;
+    header.keyframes = snapshot.keyframes;
+
+    // tiles the buffers share are stored once
+    std::unordered_map<const PackedTile*, int> uses;
+    std::vector<const PackedTile*> shared;
+    SharedTiles shared_index;
+    for (size_t i = 0; i < snapshot.frames.size(); ++i) {
+        if (snapshot.inks[i].empty()) {
+            continue;
+        }
+        for (auto &tile : snapshot.frames[i].tiles) {
+            if (tile && ++uses[tile.get()] == 2) {
+                shared_index[tile.get()] = shared.size();
+                shared.push_back(tile.get());
+            }
+        }
+    }
+    header.shared_tiles = shared.size();
+
+    std::vector<ProjectEntry> entries(snapshot.frames.size());
+    std::vector<ProjectTile> tile_entries(shared.size());
+    // the tiles of frames between keyframes that are cheaper as deltas
+    auto deltas = [&](size_t frame, PackedFrame &tiles, std::vector<bool> &delta) {
+        tiles = snapshot.frames[frame];
+        delta.clear();
+        if (!snapshot.keyframes || frame >= header.frames || frame % snapshot.keyframes == 0) {
+            return;
+        }
+        size_t key = frame - frame % snapshot.keyframes;
+        auto &key_tiles = snapshot.frames[key];
+        if (key_tiles.empty() || snapshot.inks[key].empty()) {
+            return;
+        }
+        TileGrid grid(snapshot.dimx, snapshot.dimy);
+        std::vector<Uint8> data;
+        delta.resize(tiles.tiles.size());
+        for (int ty = 0; ty < tiles.tilesy; ++ty) {
+            for (int tx = 0; tx < tiles.tilesx; ++tx) {
+                int i = tx + ty * tiles.tilesx;
+                auto &tile = tiles.tiles[i];
+                if (!tile || !key_tiles.tiles[i] || shared_index.count(tile.get())) {
+                    continue;
+                }
+                auto rect = grid.tileRect(tx, ty);
+                xorTiles(key_tiles.tiles[i].get(), tile.get(), rect.w, rect.h, data);
+                if (!data.empty() && data.size() < tile->size) {
+                    tiles.bytes += data.size();
+                    tiles.bytes -= tile->size;
+                    tile = makeTile(data);
+                    delta[i] = true;
+                }
+            }
+        }
+    };
+
+    Uint64 offset = projectHeaderSize(PROJECT_VERSION) + entries.size() * sizeof(ProjectEntry) + tile_entries.size() * sizeof(ProjectTile);
+    offset = (offset + PROJECT_PAGE - 1) / PROJECT_PAGE * PROJECT_PAGE;
+    bool ok = fseeko(file, offset, SEEK_SET) == 0;
+    for (size_t i = 0; i < shared.size() && ok; ++i) {
+        tile_entries[i] = ProjectTile{offset, (Uint32)shared[i]->size, 0};
+        ok = fwrite(shared[i]->data, 1, shared[i]->size, file) == shared[i]->size;
+        offset += shared[i]->size;
+    }
+    std::vector<Uint8> blob;
+    PackedFrame tiles;
+    std::vector<bool> delta;
+    for (size_t i = 0; i < entries.size() && ok; ++i) {
+        auto &ink = snapshot.inks[i];
+        entries[i] = ProjectEntry{0, 0, ink.x0, ink.y0, ink.x1, ink.y1};
+        if (snapshot.frames[i].empty() || ink.empty()) {
+            continue;
+        }
+        deltas(i, tiles, delta);
+        blob.clear();
+        writeFrameBlob(tiles, blob, &shared_index, delta.empty() ? nullptr : &delta);
+        offset = (offset + PROJECT_PAGE - 1) / PROJECT_PAGE * PROJECT_PAGE;
+        entries[i].offset = offset;
+        entries[i].size = blob.size();
+        ok = fseeko(file, offset, SEEK_SET) == 0 && fwrite(blob.data(), 1, blob.size(), file) == blob.size();
+        offset += blob.size();
+    }
+
+    ok = ok && fseeko(file, 0, SEEK_SET) == 0 &&
+         fwrite(&header, sizeof header, 1, file) == 1 &&
+         fwrite(entries.data(), sizeof(ProjectEntry), entries.size(), file) == entries.size() &&
+         (tile_entries.empty() ||
+          fwrite(tile_entries.data(), sizeof(ProjectTile), tile_entries.size(), file) == tile_entries.size()) &&
+         fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path) < 0) {
+        perror(path);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool saveProject(const char *path, FrameBuffer &fb, Buffer &background, int frame_cnt, int frame_rate,
+                 int keyframes=0) {
+    return writeProject(path, snapshotProject(fb, background, frame_cnt, frame_rate, keyframes));
+}
+
+#endif
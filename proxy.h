@@ -0,0 +1,341 @@
+#ifndef _PROXY_H
+#define _PROXY_H
+
+#include <algorithm>
+#include <future>
+#include <string>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+#include "bounds.h"
+#include "codec.h"
+#include "compositor.h"
+#include "export.h"
+#include "framebuffer.h"
+#include "tiles.h"
+#include "worker.h"
+
+
+// proxy levels, each half the size of the one before: 1/2 and 1/4 of
+// the canvas each way
+#define PROXY_LEVELS 2
+// share of the video memory budget proxy textures take, 1/N
+#define PROXY_TEXTURE_SHARE 8
+
+// a texture that's filtered when drawn at another size
+SDL_Texture *createScaledTexture(SDL_Renderer *renderer, int access, int w, int h) {
+    auto quality = SDL_GetHint(SDL_HINT_RENDER_SCALE_QUALITY);
+    std::string restore = quality ? quality : "0";
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
+    auto res = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, access, w, h);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, restore.c_str());
+    return res;
+}
+
+// hash of every tile of packed, 0 for blank ones
+std::vector<Uint64> hashTiles(const PackedFrame &packed) {
+    std::vector<Uint64> res(packed.tiles.size());
+    for (size_t i = 0; i < res.size(); ++i) {
+        auto tile = packed.tiles[i].get();
+        res[i] = tile ? hashBytes(tile->data, tile->size) | 1 : 0;
+    }
+    return res;
+}
+
+// Shrinks src, dimx x dimy, to half its size each way. Only the tiles of
+// the result that cover tiles whose hashes differ from old_hashes are
+// made again, the rest are taken from old, what src was shrunk to when
+// it had old_hashes (none for a blank one).
+PackedFrame halvePacked(const PackedFrame &src, const std::vector<Uint64> &hashes,
+                        const std::vector<Uint64> &old_hashes, const PackedFrame &old, int dimx, int dimy) {
+    if (src.empty()) {
+        return PackedFrame{};
+    }
+    TileGrid grid(dimx, dimy), half(dimx / 2, dimy / 2);
+    PackedFrame res;
+    res.tilesx = half.getTilesX();
+    res.tilesy = half.getTilesY();
+    res.tiles.resize(res.tilesx * res.tilesy);
+    // the 2x2 tiles of src a tile of the result is made of
+    Uint8 scratch[4 * 4 * TILE_SIZE * TILE_SIZE], out[4 * TILE_SIZE * TILE_SIZE];
+    const int pitch = 4 * 2 * TILE_SIZE;
+    std::vector<Uint8> data;
+    for (int ty = 0; ty < res.tilesy; ++ty) {
+        for (int tx = 0; tx < res.tilesx; ++tx) {
+            int sx1 = std::min(2 * tx + 1, src.tilesx - 1), sy1 = std::min(2 * ty + 1, src.tilesy - 1);
+            bool changed = false;
+            for (int sy = 2 * ty; sy <= sy1; ++sy) {
+                for (int sx = 2 * tx; sx <= sx1; ++sx) {
+                    int i = sx + sy * src.tilesx;
+                    changed = changed || hashes[i] != (old_hashes.empty() ? 0 : old_hashes[i]);
+                }
+            }
+            auto &tile = res.tiles[tx + ty * res.tilesx];
+            if (!changed) {
+                tile = old.empty() ? nullptr : old.tiles[tx + ty * res.tilesx];
+                res.bytes += tile ? tile->size : 0;
+                continue;
+            }
+            auto rect = half.tileRect(tx, ty);
+            bool blank = true;
+            for (int sy = 2 * ty; sy <= sy1; ++sy) {
+                for (int sx = 2 * tx; sx <= sx1; ++sx) {
+                    auto r = grid.tileRect(sx, sy);
+                    auto t = src.tiles[sx + sy * src.tilesx].get();
+                    decodeTile(t, scratch + (r.y - 2 * rect.y) * pitch + 4 * (r.x - 2 * rect.x), pitch, r.w, r.h);
+                    blank = blank && !t;
+                }
+            }
+            if (blank) {
+                continue;
+            }
+            for (int y = 0; y < rect.h; ++y) {
+                halveRows(scratch + 2 * y * pitch, scratch + (2 * y + 1) * pitch, out + 4 * rect.w * y,
+                          rect.w, 2 * rect.w);
+            }
+            encodeTile(out, 4 * rect.w, rect.w, rect.h, data);
+            if (!data.empty()) {
+                tile = TileCache::get().intern(makeTile(data));
+                res.bytes += data.size();
+            }
+        }
+    }
+    return res;
+}
+
+// Reduced resolution copies of the frames, drawn instead of them when
+// they're still being read back, decoded or uploaded, or when drawing
+// them at full size can't keep up. Every level is halved from the one
+// above on the worker, incrementally: only tiles under tiles that
+// changed since the last time are made again. Levels are kept packed,
+// textures are only made for the frames drawn last.
+class ProxyFrames {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Levels {
+        // hashes of the tiles of the frame the levels were made from
+        std::vector<Uint64> hashes;
+        PackedFrame levels[PROXY_LEVELS];
+    };
+
+    struct Proxy {
+        Levels built;
+        // in canvas coordinates
+        Bounds ink;
+        // the frame version the levels are of
+        unsigned version = 0;
+        bool has = false;
+        std::future<Levels> building;
+        unsigned building_version = 0;
+        Bounds building_ink;
+        SDL_Texture *textures[PROXY_LEVELS] = {};
+        unsigned texture_versions[PROXY_LEVELS] = {};
+        Clock::time_point drawn[PROXY_LEVELS];
+    };
+
+    SDL_Renderer *_renderer;
+    int _dimx, _dimy;
+    std::vector<Proxy> _proxies;
+    int _building = 0;
+    size_t _texture_budget, _texture_bytes = 0;
+    std::vector<Uint8> _scratch;
+
+    int _levelX(int level) const {
+        return _dimx >> level;
+    }
+
+    int _levelY(int level) const {
+        return _dimy >> level;
+    }
+
+    size_t _levelBytes(int level) const {
+        return 4ull * _levelX(level) * _levelY(level);
+    }
+
+    void _dropTexture(Proxy &proxy, int level) {
+        auto &texture = proxy.textures[level - 1];
+        if (texture) {
+            SDL_DestroyTexture(texture);
+            texture = nullptr;
+            _texture_bytes -= _levelBytes(level);
+        }
+    }
+
+    void _limitTextures() {
+        while (_texture_budget && _texture_bytes > _texture_budget) {
+            Proxy *oldest = nullptr;
+            int oldest_level = 0;
+            for (auto &proxy : _proxies) {
+                for (int level = 1; level <= PROXY_LEVELS; ++level) {
+                    if (proxy.textures[level - 1] &&
+                            (!oldest || proxy.drawn[level - 1] < oldest->drawn[oldest_level - 1])) {
+                        oldest = &proxy;
+                        oldest_level = level;
+                    }
+                }
+            }
+            _dropTexture(*oldest, oldest_level);
+        }
+    }
+
+    SDL_Texture *_ensureTexture(Proxy &proxy, int level) {
+        auto &texture = proxy.textures[level - 1];
+        proxy.drawn[level - 1] = Clock::now();
+        if (texture && proxy.texture_versions[level - 1] == proxy.version) {
+            return texture;
+        }
+        int w = _levelX(level), h = _levelY(level);
+        if (!texture) {
+            texture = createScaledTexture(_renderer, SDL_TEXTUREACCESS_STATIC, w, h);
+            if (!texture) {
+                return nullptr;
+            }
+            SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_ADD);
+            _texture_bytes += _levelBytes(level);
+            _limitTextures();
+        }
+        _scratch.resize(_levelBytes(level));
+        unpackPixels(proxy.built.levels[level - 1], _scratch.data(), 4 * w, TileGrid(w, h));
+        SDL_UpdateTexture(texture, nullptr, _scratch.data(), 4 * w);
+        proxy.texture_versions[level - 1] = proxy.version;
+        return texture;
+    }
+
+public:
+    // texture_budget in bytes, the least recently drawn textures go first
+    // past it, 0 keeps every texture
+    ProxyFrames(SDL_Renderer *renderer, int dimx, int dimy, int frames, size_t texture_budget) :
+        _renderer(renderer), _dimx(dimx), _dimy(dimy), _proxies(frames), _texture_budget(texture_budget)
+    {
+    }
+
+    ~ProxyFrames() {
+        for (auto &proxy : _proxies) {
+            // the worker only holds copies, nothing to wait for
+            for (int level = 1; level <= PROXY_LEVELS; ++level) {
+                _dropTexture(proxy, level);
+            }
+        }
+    }
+
+    // true if the proxy shows the frame as it is now
+    bool has(FrameBuffer &fb, int frame) const {
+        auto &proxy = _proxies[frame];
+        return proxy.has && proxy.version == fb.getVersion(frame);
+    }
+
+    int getBuiltCount(FrameBuffer &fb) const {
+        int res = 0;
+        for (int frame = 0; frame < (int)_proxies.size(); ++frame) {
+            res += has(fb, frame);
+        }
+        return res;
+    }
+
+    // packed bytes of every level, and of the textures
+    size_t getBytes() const {
+        size_t res = 0;
+        for (auto &proxy : _proxies) {
+            for (auto &level : proxy.built.levels) {
+                res += level.bytes;
+            }
+        }
+        return res;
+    }
+
+    size_t getTextureBytes() const {
+        return _texture_bytes;
+    }
+
+    // Picks up proxies the worker is done with and starts updating those
+    // of packed frames that changed, nearest to frame first
+    void update(FrameBuffer &fb, Worker &worker, int frame) {
+        int frames = _proxies.size();
+        for (int i = 0; i < frames; ++i) {
+            int f = (frame + i) % frames;
+            auto &proxy = _proxies[f];
+            if (proxy.building.valid()) {
+                if (proxy.building.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                    continue;
+                }
+                proxy.built = proxy.building.get();
+                proxy.version = proxy.building_version;
+                proxy.ink = proxy.building_ink;
+                proxy.has = true;
+                --_building;
+            }
+            if (has(fb, f) || _building >= worker.getThreadCount()) {
+                continue;
+            }
+            PackedFrame tiles;
+            Bounds ink;
+            if (!fb.peekFrame(f, tiles, ink)) {
+                continue;
+            }
+            if (ink.empty()) {
+                proxy.built = Levels{};
+                proxy.version = fb.getVersion(f);
+                proxy.ink = ink;
+                proxy.has = true;
+                continue;
+            }
+            int dimx = _dimx, dimy = _dimy;
+            auto old = proxy.built;
+            proxy.building_version = fb.getVersion(f);
+            proxy.building_ink = ink;
+            proxy.building = worker.submit([tiles, old, dimx, dimy] {
+                Levels res;
+                res.hashes = hashTiles(tiles);
+                auto *src = &tiles;
+                auto hashes = res.hashes, old_hashes = old.hashes;
+                for (int level = 1; level <= PROXY_LEVELS; ++level) {
+                    res.levels[level - 1] = halvePacked(*src, hashes, old_hashes, old.levels[level - 1],
+                                                        dimx >> (level - 1), dimy >> (level - 1));
+                    src = &res.levels[level - 1];
+                    hashes = hashTiles(*src);
+                    old_hashes = hashTiles(old.levels[level - 1]);
+                }
+                return res;
+            });
+            ++_building;
+        }
+    }
+
+    // A layer drawing the proxy at level (1 is half size) over the whole
+    // canvas, false if it isn't current or is blank
+    bool getLayer(FrameBuffer &fb, int frame, int level, Layer &layer, int tintr=255, int tintg=255,
+                  int tintb=255) {
+        auto &proxy = _proxies[frame];
+        if (!has(fb, frame) || proxy.ink.empty()) {
+            return false;
+        }
+        auto texture = _ensureTexture(proxy, level);
+        if (!texture) {
+            return false;
+        }
+        layer = Layer{texture, 0, 0, 0, 0, _dimx, _dimy, tintr/255.f, tintg/255.f, tintb/255.f, proxy.ink.rect()};
+        return true;
+    }
+
+    // draws the proxy at level scaled up to the canvas, added like the
+    // frames are
+    void render(FrameBuffer &fb, int frame, int level, int tintr=255, int tintg=255, int tintb=255) {
+        auto &proxy = _proxies[frame];
+        if (!has(fb, frame) || proxy.ink.empty()) {
+            return;
+        }
+        auto texture = _ensureTexture(proxy, level);
+        if (!texture) {
+            return;
+        }
+        int scale = 1 << level;
+        auto where = proxy.ink.rect();
+        SDL_Rect what{where.x / scale, where.y / scale, (where.w + scale - 1) / scale, (where.h + scale - 1) / scale};
+        where = SDL_Rect{what.x * scale, what.y * scale, what.w * scale, what.h * scale};
+        SDL_SetTextureColorMod(texture, tintr, tintg, tintb);
+        SDL_RenderCopy(_renderer, texture, &what, &where);
+    }
+};
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef _REGRESS_H
+#define _REGRESS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <SDL2/SDL.h>
+
+#include "batch.h"
+#include "brush.h"
+#include "buffer.h"
+#include "codec.h"
+#include "export.h"
+#include "framebuffer.h"
+#include "options.h"
+#include "project.h"
+#include "strokes.h"
+#include "tiles.h"
+#include "worker.h"
+
+
+// canvas of a log without a golden project yet
+#define REGRESS_DIMX 1920
+#define REGRESS_DIMY 1080
+// every timing is the best of this many runs
+#define REGRESS_RUNS 5
+// timings this close to the baseline pass whatever the threshold, below
+// it they're mostly noise
+#define REGRESS_SLACK_MS 1.0
+
+// Milliseconds this machine takes to pack and unpack a canvas of stripes,
+// the best of REGRESS_RUNS. Timings are kept in units of it, so that a
+// baseline holds on machines faster or slower than the one it was made on.
+double calibrate() {
+    TileGrid grid(REGRESS_DIMX, REGRESS_DIMY);
+    int pitch = 4 * REGRESS_DIMX;
+    std::vector<Uint8> canvas(4ull * REGRESS_DIMX * REGRESS_DIMY), out(canvas.size());
+    for (int y = 0; y < REGRESS_DIMY; ++y) {
+        for (int x = y * 7 % 64; x < REGRESS_DIMX; x += 64) {
+            memset(&canvas[4ull * (REGRESS_DIMX * y + x)], 255, 4 * std::min(12, REGRESS_DIMX - x));
+        }
+    }
+    double best = 1e9;
+    for (int run = 0; run < 2 * REGRESS_RUNS; ++run) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < 4; ++i) {
+            auto packed = packPixels(canvas.data(), pitch, grid);
+            unpackPixels(packed, out.data(), pitch, grid);
+        }
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - t0;
+        best = std::min(best, took.count() / 4);
+    }
+    return best;
+}
+
+// name -> timing in units of calibrate(), one "name units" per line
+std::map<std::string, double> readBaseline(const std::string &path) {
+    std::map<std::string, double> res;
+    auto file = fopen(path.c_str(), "r");
+    if (!file) {
+        return res;
+    }
+    char name[256];
+    double ms;
+    while (fscanf(file, "%255s %lf", name, &ms) == 2) {
+        res[name] = ms;
+    }
+    fclose(file);
+    return res;
+}
+
+bool writeBaseline(const std::string &path, const std::map<std::string, double> &timings) {
+    auto file = fopen(path.c_str(), "w");
+    if (!file) {
+        perror(path.c_str());
+        return false;
+    }
+    for (auto &timing : timings) {
+        fprintf(file, "%s %.6g\n", timing.first.c_str(), timing.second);
+    }
+    return fclose(file) == 0;
+}
+
+// Pixels of frame in a and b further apart than tolerance in any channel
+size_t countDifferences(const ProjectSnapshot &a, const ProjectSnapshot &b, int frame, int tolerance,
+                        std::vector<Uint8> &pa, std::vector<Uint8> &pb) {
+    TileGrid grid(a.dimx, a.dimy);
+    pa.assign(4ull * a.dimx * a.dimy, 0);
+    pb.assign(pa.size(), 0);
+    unpackPixels(a.frames[frame], pa.data(), 4 * a.dimx, grid);
+    unpackPixels(b.frames[frame], pb.data(), 4 * a.dimx, grid);
+    size_t res = 0;
+    for (size_t i = 0; i < pa.size(); i += 4) {
+        for (int c = 0; c < 4; ++c) {
+            if (abs(pa[i + c] - pb[i + c]) > tolerance) {
+                ++res;
+                break;
+            }
+        }
+    }
+    return res;
+}
+
+// Replays every DIR/NAME.strokes on a blank canvas and compares the
+// frames with the golden project DIR/NAME.xfb, and how long drawing,
+// packing and compositing took with DIR/baseline.txt. Fails if a pixel
+// is off by more than the tolerance or a timing is slower than the
+// baseline by more than the threshold, or a golden or timing is missing.
+// Timings are compared in units of calibrate(); --update-goldens rewrites
+// the goldens and the baseline.
+int runRegression(const Options &opts) {
+    std::string dir = opts.regress;
+    std::vector<std::string> names;
+    if (auto d = opendir(dir.c_str())) {
+        while (auto entry = readdir(d)) {
+            std::string name = entry->d_name;
+            auto ext = name.rfind(".strokes");
+            if (ext != std::string::npos && ext + strlen(".strokes") == name.size()) {
+                names.push_back(name.substr(0, ext));
+            }
+        }
+        closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+    if (names.empty()) {
+        fprintf(stderr, "%s: no stroke logs\n", dir.c_str());
+        return 1;
+    }
+
+    auto baseline_path = dir + "/baseline.txt";
+    auto baseline = readBaseline(baseline_path);
+    std::map<std::string, double> timings;
+    // before and after the logs, whichever ran on a quieter machine
+    auto unit = calibrate();
+    Worker worker;
+    bool ok = true;
+    for (auto &name : names) {
+        auto strokes = StrokeLog::strokesAfter(StrokeLog::load((dir + "/" + name + ".strokes").c_str()), 0);
+        auto golden_path = dir + "/" + name + ".xfb";
+        Project golden;
+        bool compare = !opts.update_goldens;
+        if (compare && access(golden_path.c_str(), F_OK) != 0) {
+            fprintf(stderr, "%s: no golden project, --update-goldens writes it\n", golden_path.c_str());
+            ok = false;
+            continue;
+        }
+        if (compare && !golden.open(golden_path.c_str())) {
+            ok = false;
+            continue;
+        }
+        int dimx = compare ? golden.getDimX() : REGRESS_DIMX, dimy = compare ? golden.getDimY() : REGRESS_DIMY;
+        int frames = 1;
+        for (auto &stroke : strokes) {
+            frames = std::max(frames, stroke.frame + 1);
+        }
+        frames = compare ? golden.getFrames() : frames;
+
+        ProjectSnapshot drawn;
+        double best[3] = {1e9, 1e9, 1e9};
+        for (int run = 0; run < REGRESS_RUNS; ++run) {
+            FrameBuffer fb(nullptr, frames, dimx, dimy, 1, 1);
+            Buffer background(nullptr, dimx, dimy);
+            Brush<1> pencil;
+            Brush<0> eraser;
+            auto t0 = std::chrono::steady_clock::now();
+            for (auto &stroke : strokes) {
+                replayStroke(stroke, fb, background, pencil, eraser);
+            }
+            auto t1 = std::chrono::steady_clock::now();
+            drawn = snapshotProject(fb, background, frames, 12);
+            auto t2 = std::chrono::steady_clock::now();
+            ExportOptions onion;
+            onion.onion_prev = onion.onion_next = true;
+            std::vector<Uint8> canvas(4ull * dimx * dimy), scratch;
+            for (int f = 0; f < frames; ++f) {
+                compositeFrame(drawn, f, onion, canvas.data(), scratch);
+            }
+            auto t3 = std::chrono::steady_clock::now();
+            std::chrono::duration<double, std::milli> took[] = {t1 - t0, t2 - t1, t3 - t2};
+            for (int i = 0; i < 3; ++i) {
+                best[i] = std::min(best[i], took[i].count());
+            }
+        }
+        const char *stages[] = {"draw", "pack", "composite"};
+        for (int i = 0; i < 3; ++i) {
+            timings[name + "." + stages[i]] = best[i];
+        }
+
+        if (!compare) {
+            fprintf(stderr, "%s: %d strokes, writing the golden project\n", name.c_str(), (int)strokes.size());
+            ok = writeProject(golden_path.c_str(), drawn) && ok;
+            continue;
+        }
+        FrameBuffer fb(nullptr, frames, dimx, dimy, 1, 1);
+        Buffer background(nullptr, dimx, dimy);
+        loadProject(golden, fb, background, worker);
+        auto expected = snapshotProject(fb, background, frames, 12);
+        std::vector<Uint8> pa, pb;
+        for (size_t f = 0; f < drawn.frames.size(); ++f) {
+            auto differ = countDifferences(drawn, expected, f, opts.regress_tolerance, pa, pb);
+            if (differ) {
+                fprintf(stderr, "%s: %zu pixels of %s differ from the golden project\n", name.c_str(), differ,
+                        f + 1 < drawn.frames.size() ? ("frame " + std::to_string(f)).c_str() : "the background");
+                ok = false;
+            }
+        }
+    }
+
+    // baselines are shown in this machine's milliseconds
+    unit = std::min(unit, calibrate());
+    if (opts.update_goldens) {
+        baseline.clear();
+    }
+    printf("%-32s %10s %10s %8s\n", "timing", "ms", "baseline", "change");
+    bool missing = false;
+    for (auto &timing : timings) {
+        auto base = baseline.find(timing.first);
+        if (opts.update_goldens) {
+            printf("%-32s %10.2f %10s %8s\n", timing.first.c_str(), timing.second, "-", "-");
+            baseline[timing.first] = timing.second / unit;
+            continue;
+        }
+        if (base == baseline.end()) {
+            printf("%-32s %10.2f %10s %8s MISSING\n", timing.first.c_str(), timing.second, "-", "-");
+            missing = true;
+            ok = false;
+            continue;
+        }
+        double expected = base->second * unit;
+        double change = expected > 0 ? (timing.second / expected - 1) * 100 : 0;
+        bool slower = change > opts.regress_threshold && timing.second - expected > REGRESS_SLACK_MS;
+        printf("%-32s %10.2f %10.2f %+7.1f%%%s\n", timing.first.c_str(), timing.second, expected, change,
+               slower ? " SLOWER" : "");
+        ok = ok && !slower;
+    }
+    if (opts.update_goldens) {
+        ok = writeBaseline(baseline_path, baseline) && ok;
+    } else if (missing) {
+        fprintf(stderr, "%s: no baseline for some timings, --update-goldens writes it\n",
+                baseline_path.c_str());
+    }
+    printf("%s\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef _SPILL_H
+#define _SPILL_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <SDL2/SDL.h>
+
+#include "codec.h"
+
+
+// Physical memory in megabytes
+int queryPhysicalMemory() {
+    long long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGE_SIZE);
+    if (pages <= 0 || page_size <= 0) {
+        return 0;
+    }
+    return pages * page_size >> 20;
+}
+
+// Scratch file for packed frames that don't fit into the memory budget.
+// Slots are handed out on the main thread, reads and writes are
+// positioned and may run on any thread.
+class SpillFile {
+public:
+    struct Slot {
+        long long offset = -1;
+        size_t size = 0, capacity = 0;
+
+        bool valid() const {
+            return offset >= 0;
+        }
+    };
+
+private:
+    int _fd;
+    long long _end = 0;
+    std::vector<Slot> _free;
+
+public:
+    SpillFile(const std::string &dir) {
+        auto path = dir + "/xflipbook-spill-XXXXXX";
+        _fd = mkstemp(&path[0]);
+        if (_fd < 0) {
+            fprintf(stderr, "Can't create a scratch file in %s, frames won't be spilled\n", dir.c_str());
+            return;
+        }
+        // goes away with the last descriptor, even if we crash
+        unlink(path.c_str());
+    }
+
+    ~SpillFile() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    bool ok() const {
+        return _fd >= 0;
+    }
+
+    // bytes taken on disk, including released slots
+    long long getFileSize() const {
+        return _end;
+    }
+
+    // keeps old if it's big enough, first fit otherwise
+    Slot allocate(size_t size, Slot old) {
+        if (old.valid() && old.capacity >= size) {
+            old.size = size;
+            return old;
+        }
+        release(old);
+        for (auto it = _free.begin(); it != _free.end(); ++it) {
+            if (it->capacity >= size) {
+                auto slot = *it;
+                _free.erase(it);
+                slot.size = size;
+                return slot;
+            }
+        }
+        Slot slot;
+        slot.offset = _end;
+        slot.size = slot.capacity = size;
+        _end += size;
+        return slot;
+    }
+
+    void release(Slot slot) {
+        if (slot.valid()) {
+            _free.push_back(slot);
+        }
+    }
+
+    // tiles in shared are written as their index only, read() gets them
+    // back from the same list
+    bool write(const Slot &slot, const PackedFrame &packed, const SharedTiles *shared=nullptr) {
+        std::vector<Uint8> blob;
+        blob.reserve(slot.size);
+        writeFrameBlob(packed, blob, shared);
+        size_t done = 0;
+        while (done < blob.size()) {
+            auto res = pwrite(_fd, blob.data() + done, blob.size() - done, slot.offset + done);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                perror("Writing the scratch file");
+                return false;
+            }
+            done += res;
+        }
+        return true;
+    }
+
+    bool read(const Slot &slot, PackedFrame &packed, const std::vector<TileRef> *shared=nullptr) {
+        packed = PackedFrame{};
+        auto blob = std::make_shared<std::vector<Uint8>>(slot.size);
+        size_t done = 0;
+        while (done < blob->size()) {
+            auto res = pread(_fd, blob->data() + done, blob->size() - done, slot.offset + done);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res == 0) {
+                fprintf(stderr, "Reading the scratch file: it ends early\n");
+                return false;
+            }
+            if (res < 0) {
+                perror("Reading the scratch file");
+                return false;
+            }
+            done += res;
+        }
+        // the tiles share the blob
+        return readFrameBlob(blob->data(), blob->size(), blob, false, packed, shared);
+    }
+};
+
+#endif
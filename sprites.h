@@ -0,0 +1,242 @@
+#ifndef _SPRITES_H
+#define _SPRITES_H
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <png.h>
+#include <SDL2/SDL.h>
+
+#define STBRP_STATIC
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "imgui/stb_rect_pack.h"
+
+#include "bounds.h"
+#include "codec.h"
+#include "project.h"
+#include "tiles.h"
+#include "worker.h"
+
+
+// empty space around every sprite so filtering doesn't bleed
+#define SPRITE_PADDING 1
+
+// Where a frame ended up: a rect of a sheet showing ink, a rect of the
+// canvas. Frames without ink have an empty ink and no rect.
+struct Sprite {
+    int sheet = -1;
+    int x = 0, y = 0, w = 0, h = 0;
+    Bounds ink;
+    // the earlier frame drawn exactly the same, whose sprite this is
+    int same_as = -1;
+};
+
+struct SpriteSheets {
+    std::vector<SDL_Point> sizes;
+    std::vector<Sprite> sprites;
+};
+
+// Packs the ink of every frame into as few power of two sheets of at most
+// max_size as it can, each as small as it can. Identical frames, which
+// share their tiles, share a sprite. False if a frame's ink doesn't fit
+// on a sheet with its padding.
+bool packSprites(const ProjectSnapshot &snapshot, int count, int max_size, SpriteSheets &res) {
+    res = SpriteSheets{};
+    res.sprites.resize(count);
+    std::vector<stbrp_rect> left;
+    for (int f = 0; f < count; ++f) {
+        auto &sprite = res.sprites[f];
+        sprite.ink = snapshot.inks[f].clipped(snapshot.dimx, snapshot.dimy);
+        if (sprite.ink.empty()) {
+            continue;
+        }
+        for (int g = 0; g < f && sprite.same_as < 0; ++g) {
+            auto &other = res.sprites[g].ink;
+            if (other.x0 == sprite.ink.x0 && other.y0 == sprite.ink.y0 && other.x1 == sprite.ink.x1 &&
+                    other.y1 == sprite.ink.y1 && snapshot.frames[g].tiles == snapshot.frames[f].tiles) {
+                sprite.same_as = g;
+            }
+        }
+        if (sprite.same_as < 0) {
+            auto rect = sprite.ink.rect();
+            // padding on both sides, the sheet's own is taken off the area packed
+            if (std::max(rect.w, rect.h) + 2 * SPRITE_PADDING > max_size) {
+                fprintf(stderr, "The ink of frame %d is %dx%d, it doesn't fit on a %dx%d sheet\n", f, rect.w, rect.h,
+                        max_size, max_size);
+                return false;
+            }
+            stbrp_rect r{f, stbrp_coord(rect.w + SPRITE_PADDING), stbrp_coord(rect.h + SPRITE_PADDING), 0, 0, 0};
+            left.push_back(r);
+        }
+    }
+    std::vector<stbrp_node> nodes(max_size);
+    auto pack = [&](std::vector<stbrp_rect> &rects, int w, int h) {
+        stbrp_context context;
+        stbrp_init_target(&context, w - SPRITE_PADDING, h - SPRITE_PADDING, nodes.data(), nodes.size());
+        stbrp_pack_rects(&context, rects.data(), rects.size());
+        return std::all_of(rects.begin(), rects.end(), [](const stbrp_rect &r) { return r.was_packed; });
+    };
+    while (!left.empty()) {
+        // the smallest sheet everything left fits on, wider before taller
+        size_t area = 0;
+        for (auto &r : left) {
+            area += (size_t)r.w * r.h;
+        }
+        int w = 1, h = 1;
+        auto rects = left;
+        bool fits = false;
+        while (!fits && (w < max_size || h < max_size)) {
+            if (h < w) {
+                h *= 2;
+            } else {
+                w *= 2;
+            }
+            fits = (size_t)w * h >= area && pack(rects = left, w, h);
+        }
+        if (!fits) {
+            pack(rects = left, w, h);
+        }
+        // every sprite fits on an empty sheet, this is just in case
+        if (std::none_of(rects.begin(), rects.end(), [](const stbrp_rect &r) { return r.was_packed; })) {
+            fprintf(stderr, "Sprites don't fit on a %dx%d sheet\n", max_size, max_size);
+            return false;
+        }
+        left.clear();
+        for (auto &r : rects) {
+            if (!r.was_packed) {
+                left.push_back(r);
+                continue;
+            }
+            auto &sprite = res.sprites[r.id];
+            sprite.sheet = res.sizes.size();
+            sprite.x = r.x + SPRITE_PADDING;
+            sprite.y = r.y + SPRITE_PADDING;
+            sprite.w = r.w - SPRITE_PADDING;
+            sprite.h = r.h - SPRITE_PADDING;
+        }
+        res.sizes.push_back(SDL_Point{w, h});
+    }
+    for (auto &sprite : res.sprites) {
+        if (sprite.same_as >= 0) {
+            auto same_as = sprite.same_as;
+            sprite = res.sprites[same_as];
+            sprite.same_as = same_as;
+        }
+    }
+    return true;
+}
+
+bool writePNG(const char *path, const Uint8 *rgba, int w, int h) {
+    auto file = fopen(path, "wb");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    auto png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    auto info = png ? png_create_info_struct(png) : nullptr;
+    if (!info || setjmp(png_jmpbuf(png))) {
+        fprintf(stderr, "%s: writing the PNG failed\n", path);
+        png_destroy_write_struct(&png, &info);
+        fclose(file);
+        return false;
+    }
+    png_init_io(png, file);
+    png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    // sheets are mostly empty, speed matters more than the last few bytes
+    png_set_compression_level(png, 3);
+    png_write_info(png, info);
+    for (int y = 0; y < h; ++y) {
+        png_write_row(png, (png_const_bytep)(rgba + 4ull * w * y));
+    }
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return fclose(file) == 0;
+}
+
+// Writes the frames of the snapshot trimmed to their ink and packed into
+// PREFIX-N.png sheets, and where each went into PREFIX.json and PREFIX.csv.
+// Sheets are RGBA with straight alpha, frames are decoded on the worker.
+bool exportSprites(const ProjectSnapshot &snapshot, const char *prefix, int max_size, Worker &worker) {
+    int dimx = snapshot.dimx, dimy = snapshot.dimy;
+    int count = std::max(1, std::min<int>(snapshot.frame_cnt, snapshot.frames.size() - 1));
+    SpriteSheets sheets;
+    if (!packSprites(snapshot, count, max_size, sheets)) {
+        return false;
+    }
+    auto name = [&](int sheet) {
+        auto path = std::string(prefix) + "-" + std::to_string(sheet) + ".png";
+        auto slash = path.rfind('/');
+        return slash == std::string::npos ? path : path.substr(slash + 1);
+    };
+
+    bool ok = true;
+    for (int sheet = 0; sheet < (int)sheets.sizes.size() && ok; ++sheet) {
+        auto size = sheets.sizes[sheet];
+        std::vector<Uint8> pixels(4ull * size.x * size.y);
+        worker.parallelFor(count, [&](int f) {
+            auto &sprite = sheets.sprites[f];
+            if (sprite.sheet != sheet || sprite.same_as >= 0) {
+                return;
+            }
+            std::vector<Uint8> canvas(4ull * dimx * dimy);
+            auto rect = sprite.ink.rect();
+            unpackPixels(snapshot.frames[f], canvas.data(), 4 * dimx, TileGrid(dimx, dimy), &rect);
+            for (int y = 0; y < sprite.h; ++y) {
+                auto src = &canvas[4ull * (dimx * (sprite.ink.y0 + y) + sprite.ink.x0)];
+                auto dst = &pixels[4ull * (size.x * (sprite.y + y) + sprite.x)];
+                for (int x = 0; x < sprite.w; ++x, src += 4, dst += 4) {
+                    dst[0] = src[2];
+                    dst[1] = src[1];
+                    dst[2] = src[0];
+                    dst[3] = src[3];
+                }
+            }
+        });
+        ok = writePNG((std::string(prefix) + "-" + std::to_string(sheet) + ".png").c_str(),
+                      pixels.data(), size.x, size.y);
+    }
+
+    auto json_path = std::string(prefix) + ".json", csv_path = std::string(prefix) + ".csv";
+    auto json = ok ? fopen(json_path.c_str(), "w") : nullptr;
+    auto csv = json ? fopen(csv_path.c_str(), "w") : nullptr;
+    if (!csv) {
+        if (ok) {
+            perror(json ? csv_path.c_str() : json_path.c_str());
+        }
+        if (json) {
+            fclose(json);
+        }
+        return false;
+    }
+    fprintf(json, "{\n  \"canvas\": {\"w\": %d, \"h\": %d},\n  \"frame_rate\": %d,\n  \"sheets\": [\n",
+            dimx, dimy, snapshot.frame_rate);
+    for (size_t i = 0; i < sheets.sizes.size(); ++i) {
+        fprintf(json, "    {\"image\": \"%s\", \"w\": %d, \"h\": %d}%s\n", name(i).c_str(),
+                sheets.sizes[i].x, sheets.sizes[i].y, i + 1 < sheets.sizes.size() ? "," : "");
+    }
+    fprintf(json, "  ],\n  \"frames\": [\n");
+    fprintf(csv, "frame,sheet,x,y,w,h,offset_x,offset_y,duration_ms\n");
+    // in ms, rounded so that they add up
+    auto start = [&](int frame) {
+        return (frame * 2000 / snapshot.frame_rate + 1) / 2;
+    };
+    for (int f = 0; f < count; ++f) {
+        auto &sprite = sheets.sprites[f];
+        int offx = sprite.sheet < 0 ? 0 : sprite.ink.x0, offy = sprite.sheet < 0 ? 0 : sprite.ink.y0;
+        int duration = start(f + 1) - start(f);
+        fprintf(json, "    {\"sheet\": %d, \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d, "
+                "\"offset_x\": %d, \"offset_y\": %d, \"duration_ms\": %d}%s\n",
+                sprite.sheet, sprite.x, sprite.y, sprite.w, sprite.h, offx, offy, duration,
+                f + 1 < count ? "," : "");
+        fprintf(csv, "%d,%d,%d,%d,%d,%d,%d,%d,%d\n",
+                f, sprite.sheet, sprite.x, sprite.y, sprite.w, sprite.h, offx, offy, duration);
+    }
+    fprintf(json, "  ]\n}\n");
+    ok = fclose(json) == 0;
+    return fclose(csv) == 0 && ok;
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef _STROKE_H
+#define _STROKE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+#include "tablet.h"
+#include "brush.h"
+
+
+// Stroke in progress that hasn't been rasterized yet. The pen trail is
+// shown as a triangle overlay (plus a short extrapolation along the pen
+// velocity) and the brush input is handed to the brush after the frame
+// is presented.
+class LiveStroke {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Sample {
+        TabletEvent evt;
+        Clock::time_point time;
+    };
+
+    std::vector<TabletEvent> _input;
+    // _trail[0] is the last committed position, the overlay starts from it
+    std::vector<Sample> _trail;
+    bool _ending = false;
+
+    std::vector<SDL_Vertex> _vertices;
+    std::vector<int> _indices;
+
+    static double _width(const TabletEvent &evt) {
+        // same half-width as Brush::draw
+        return 2*evt.pressure/1000.;
+    }
+
+    void _clear() {
+        _input.clear();
+        _trail.clear();
+        _ending = false;
+    }
+
+    void _addSection(Vec pos, Vec dir, double width, SDL_Color color) {
+        auto n = Vec{dir.y, -dir.x}.normalized() * std::max(width, 0.5);
+        auto base = (int)_vertices.size();
+        auto l = pos - n, r = pos + n;
+        _vertices.push_back(SDL_Vertex{{(float)l.x, (float)l.y}, color, {0, 0}});
+        _vertices.push_back(SDL_Vertex{{(float)r.x, (float)r.y}, color, {0, 0}});
+        if (base >= 2) {
+            int quad[] = {base-2, base-1, base, base-1, base+1, base};
+            _indices.insert(_indices.end(), quad, quad+6);
+        }
+    }
+
+public:
+    double predict_ms = 8;
+    double max_predict_px = 24;
+
+    // brush input, rasterized on commit
+    void push(TabletEvent evt) {
+        _input.push_back(evt);
+    }
+
+    // pen position as reported by the tablet, shown by the overlay
+    void track(TabletEvent evt) {
+        _trail.push_back(Sample{evt, Clock::now()});
+    }
+
+    bool pending() const {
+        return !_input.empty();
+    }
+
+    const std::vector<TabletEvent> &getInput() const {
+        return _input;
+    }
+
+    bool empty() const {
+        return _trail.empty();
+    }
+
+    // the pen was lifted: drop the trail once the input is committed
+    void end() {
+        _ending = true;
+        if (!pending()) {
+            _clear();
+        }
+    }
+
+    template<typename Buf, typename Br>
+    void commit(Buf &buffer, Br &brush) {
+        for (auto &evt : _input) {
+            brush.draw(evt, buffer);
+        }
+        _input.clear();
+        if (_ending) {
+            _clear();
+        } else if (_trail.size() > 1) {
+            _trail.erase(_trail.begin(), _trail.end()-1);
+        }
+    }
+
+    Vec predicted(double ahead_ms) const {
+        auto &last = _trail.back();
+        Vec pos(last.evt);
+        if (_trail.size() < 2 || ahead_ms <= 0 || _ending) {
+            return pos;
+        }
+        // velocity over the last few samples, anything older is stale
+        auto &first = _trail[_trail.size() >= 4 ? _trail.size()-4 : 0];
+        double dt = std::chrono::duration<double, std::milli>(last.time - first.time).count();
+        if (dt < 1e-3) {
+            return pos;
+        }
+        auto offset = (pos - Vec(first.evt)) * (ahead_ms / dt);
+        if (offset.len() > max_predict_px) {
+            offset = offset.normalized() * max_predict_px;
+        }
+        return pos + offset;
+    }
+
+    void render(SDL_Renderer *renderer, SDL_Color color={255, 255, 255, 255}) {
+        if (_trail.empty()) {
+            return;
+        }
+        _vertices.clear();
+        _indices.clear();
+
+        auto tip = predicted(predict_ms);
+        Vec prev;
+        for (size_t i = 0; i < _trail.size(); ++i) {
+            auto &evt = _trail[i].evt;
+            Vec pos(evt);
+            Vec next = i+1 < _trail.size() ? Vec(_trail[i+1].evt) : tip;
+            auto dir = i > 0 ? next - prev : next - pos;
+            if (dir.len() < 1e-3) {
+                dir = i > 0 ? pos - prev : Vec{1, 0};
+            }
+            _addSection(pos, dir, _width(evt), color);
+            prev = pos;
+        }
+        if ((tip - prev).len() > 0.5) {
+            _addSection(tip, tip - prev, _width(_trail.back().evt), color);
+        }
+
+        if (_indices.empty()) {
+            return;
+        }
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+        SDL_RenderGeometry(renderer, nullptr,
+                           _vertices.data(), _vertices.size(),
+                           _indices.data(), _indices.size());
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    }
+};
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef _STROKES_H
+#define _STROKES_H
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <SDL2/SDL.h>
+
+#include "tablet.h"
+
+
+// A finished stroke as the brush saw it
+struct Stroke {
+    // since the start of the session
+    Uint32 time_ms = 0;
+    int tool = 0;
+    // -1 is the background
+    int frame = -1;
+    // where the brush was left by the previous stroke
+    TabletEvent start{0, 0, 0};
+    std::vector<TabletEvent> events;
+};
+
+// Append-only log of every stroke next to the project file. Records are
+//   Uint8 type, varint size, size bytes
+// with varints in LEB128 and signed values zigzag encoded. A STROKE holds
+// time, tool, frame + 1, the start position and the events as deltas
+// from the previous one. A MARK holds a Uint64 that ties the position in
+// the log to a journal checkpoint or a save. A SESSION starts a session,
+// stroke times are relative to it. Writes go to the page cache right
+// away and are synced along with the journal.
+class StrokeLog {
+    int _fd = -1;
+    std::vector<Uint8> _record, _out;
+    std::chrono::steady_clock::time_point _session;
+
+    static void _putVarint(std::vector<Uint8> &out, Uint64 v) {
+        while (v >= 0x80) {
+            out.push_back(v | 0x80);
+            v >>= 7;
+        }
+        out.push_back(v);
+    }
+
+    static void _putSigned(std::vector<Uint8> &out, Sint64 v) {
+        _putVarint(out, (Uint64)v << 1 ^ (Uint64)(v >> 63));
+    }
+
+    static bool _getVarint(const Uint8 *&pos, const Uint8 *end, Uint64 &v) {
+        v = 0;
+        for (int shift = 0; pos < end && shift < 64; shift += 7) {
+            Uint8 b = *pos++;
+            v |= (Uint64)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool _getSigned(const Uint8 *&pos, const Uint8 *end, int &v) {
+        Uint64 u;
+        if (!_getVarint(pos, end, u)) {
+            return false;
+        }
+        v = (int)(Sint64)(u >> 1 ^ -(u & 1));
+        return true;
+    }
+
+    bool _append(Uint8 type) {
+        if (_fd < 0) {
+            return false;
+        }
+        _out.clear();
+        _out.push_back(type);
+        _putVarint(_out, _record.size());
+        _out.insert(_out.end(), _record.begin(), _record.end());
+        size_t done = 0;
+        while (done < _out.size()) {
+            auto res = write(_fd, _out.data() + done, _out.size() - done);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                perror("Writing the stroke log");
+                return false;
+            }
+            done += res;
+        }
+        return true;
+    }
+
+public:
+    enum Type { STROKE = 1, MARK = 2, SESSION = 3 };
+
+    // starts a session at the end of the log, nullptr path logs nothing
+    StrokeLog(const char *path) {
+        if (!path) {
+            return;
+        }
+        _fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (_fd < 0) {
+            perror(path);
+            return;
+        }
+        _session = std::chrono::steady_clock::now();
+        _record.clear();
+        _putVarint(_record, std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        _append(SESSION);
+    }
+
+    ~StrokeLog() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    bool ok() const {
+        return _fd >= 0;
+    }
+
+    void append(int tool, int frame, TabletEvent start, const std::vector<TabletEvent> &events) {
+        _record.clear();
+        _putVarint(_record, std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - _session).count());
+        _putVarint(_record, tool);
+        _putVarint(_record, frame + 1);
+        _putSigned(_record, start.x);
+        _putSigned(_record, start.y);
+        _putSigned(_record, start.pressure);
+        _putVarint(_record, events.size());
+        auto prev = start;
+        for (auto &evt : events) {
+            _putSigned(_record, evt.x - prev.x);
+            _putSigned(_record, evt.y - prev.y);
+            _putSigned(_record, evt.pressure - prev.pressure);
+            prev = evt;
+        }
+        _append(STROKE);
+    }
+
+    void mark(Uint64 id) {
+        _record.resize(8);
+        memcpy(_record.data(), &id, 8);
+        _append(MARK);
+    }
+
+    // called from the worker along with the journal sync
+    void sync() {
+        if (_fd >= 0) {
+            fdatasync(_fd);
+        }
+    }
+
+    // Reads the whole log. A record cut short by a crash ends it.
+    static std::vector<Uint8> load(const char *path) {
+        std::vector<Uint8> res;
+        auto file = fopen(path, "rb");
+        if (!file) {
+            return res;
+        }
+        Uint8 chunk[1 << 16];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof chunk, file)) > 0) {
+            res.insert(res.end(), chunk, chunk + n);
+        }
+        fclose(file);
+        return res;
+    }
+
+    // Calls fn(type, pos, end) for every complete record of a loaded log
+    template<typename F>
+    static void forEachRecord(const std::vector<Uint8> &log, F fn) {
+        auto pos = log.data(), end = pos + log.size();
+        while (pos < end) {
+            Uint8 type = *pos++;
+            Uint64 size;
+            if (!_getVarint(pos, end, size) || size > (Uint64)(end - pos)) {
+                return;
+            }
+            fn(type, pos, pos + size);
+            pos += size;
+        }
+    }
+
+    static bool parseStroke(const Uint8 *pos, const Uint8 *end, Stroke &stroke) {
+        Uint64 time, tool, frame, n;
+        if (!_getVarint(pos, end, time) || !_getVarint(pos, end, tool) || !_getVarint(pos, end, frame) ||
+                !_getSigned(pos, end, stroke.start.x) || !_getSigned(pos, end, stroke.start.y) ||
+                !_getSigned(pos, end, stroke.start.pressure) || !_getVarint(pos, end, n) ||
+                n > (Uint64)(end - pos)) {
+            return false;
+        }
+        stroke.time_ms = time;
+        stroke.tool = tool;
+        stroke.frame = (int)frame - 1;
+        stroke.events.resize(n);
+        auto prev = stroke.start;
+        for (auto &evt : stroke.events) {
+            int dx, dy, dp;
+            if (!_getSigned(pos, end, dx) || !_getSigned(pos, end, dy) || !_getSigned(pos, end, dp)) {
+                return false;
+            }
+            evt = TabletEvent{prev.x + dx, prev.y + dy, prev.pressure + dp};
+            prev = evt;
+        }
+        return true;
+    }
+
+    static Uint64 parseMark(const Uint8 *pos, const Uint8 *end) {
+        Uint64 id = 0;
+        if (end - pos == 8) {
+            memcpy(&id, pos, 8);
+        }
+        return id;
+    }
+
+    // Strokes after the last mark with the given id, all of them if id is 0.
+    // Nothing if the mark isn't there.
+    static std::vector<Stroke> strokesAfter(const std::vector<Uint8> &log, Uint64 id) {
+        std::vector<Stroke> res;
+        bool found = !id;
+        forEachRecord(log, [&](Uint8 type, const Uint8 *pos, const Uint8 *end) {
+            Stroke stroke;
+            if (type == MARK && id && parseMark(pos, end) == id) {
+                res.clear();
+                found = true;
+            } else if (type == STROKE && parseStroke(pos, end, stroke)) {
+                res.push_back(std::move(stroke));
+            }
+        });
+        if (!found) {
+            res.clear();
+        }
+        return res;
+    }
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef _TEXARRAY_H
+#define _TEXARRAY_H
+
+#include <algorithm>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <GL/glew.h>
+
+
+// GPU storage for frames as layers of GL_TEXTURE_2D_ARRAYs. The number
+// of layers per array is picked from GL_MAX_ARRAY_TEXTURE_LAYERS and the
+// canvas size, arrays are allocated as frames are added.
+class TextureArray {
+    int _dimx, _dimy;
+    int _layers;
+    std::vector<GLuint> _textures;
+
+    // keep single allocations within what drivers handle comfortably
+    const static long long MAX_ARRAY_BYTES = 1024ll << 20;
+
+    void _ensure(int idx) {
+        while ((int)_textures.size() <= idx) {
+            GLuint tex;
+            glGenTextures(1, &tex);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, _dimx, _dimy, _layers, 0,
+                         GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+            _textures.push_back(tex);
+        }
+    }
+
+public:
+    TextureArray(int dimx, int dimy, int frames) : _dimx(dimx), _dimy(dimy) {
+        GLint max_layers = 256;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+        long long frame_bytes = 4ll * dimx * dimy;
+        _layers = std::max(1, (int)std::min<long long>({
+            (long long)max_layers, (long long)std::max(frames, 1), MAX_ARRAY_BYTES / frame_bytes}));
+    }
+
+    ~TextureArray() {
+        glDeleteTextures(_textures.size(), _textures.data());
+    }
+
+    static bool supported(int dimx, int dimy) {
+        if (!GLEW_VERSION_3_0 && !GLEW_EXT_texture_array) {
+            return false;
+        }
+        GLint max_size = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+        return dimx <= max_size && dimy <= max_size;
+    }
+
+    int getLayersPerArray() const {
+        return _layers;
+    }
+
+    int getArrayCount() const {
+        return _textures.size();
+    }
+
+    GLuint getTexture(int frame) {
+        _ensure(frame / _layers);
+        return _textures[frame / _layers];
+    }
+
+    int getLayer(int frame) const {
+        return frame % _layers;
+    }
+
+    // pixels point at the top-left corner of the frame
+    void upload(int frame, const Uint8 *pixels, int pitch, const SDL_Rect &rect) {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, getTexture(frame));
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / 4);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, rect.x, rect.y, getLayer(frame),
+                        rect.w, rect.h, 1, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                        pixels + rect.y * pitch + rect.x * 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    // sources the rects from the pixel buffer bound by UploadRing::stage
+    void uploadStaged(int frame, const std::vector<SDL_Rect> &rects, const std::vector<size_t> &offsets) {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, getTexture(frame));
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        for (size_t i = 0; i < rects.size(); ++i) {
+            auto &rect = rects[i];
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, rect.x, rect.y, getLayer(frame),
+                            rect.w, rect.h, 1, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                            (const void*)offsets[i]);
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef _TILES_H
+#define _TILES_H
+
+#include <algorithm>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+#include "bounds.h"
+
+
+#define TILE_SIZE 64
+
+// TILE_SIZE x TILE_SIZE tiles of a dimx x dimy region. The region may be
+// split into cells of cellx x celly (the frames of an atlas); tiles then
+// start over at the corner of every cell, clipped to the cell, so each
+// frame has a grid of its own.
+class TileGrid {
+protected:
+    int _dimx, _dimy;
+    int _cellx, _celly;
+    int _cell_tilesx, _cell_tilesy;
+    int _tilesx, _tilesy;
+
+public:
+    TileGrid(int dimx=0, int dimy=0, int cellx=0, int celly=0)
+        : _dimx(dimx), _dimy(dimy), _cellx(cellx ? cellx : dimx), _celly(celly ? celly : dimy),
+          _cell_tilesx((_cellx + TILE_SIZE - 1) / TILE_SIZE), _cell_tilesy((_celly + TILE_SIZE - 1) / TILE_SIZE),
+          _tilesx(_cellx ? dimx / _cellx * _cell_tilesx : 0), _tilesy(_celly ? dimy / _celly * _cell_tilesy : 0) { }
+
+    int getDimX() const {
+        return _dimx;
+    }
+
+    int getDimY() const {
+        return _dimy;
+    }
+
+    int getTilesX() const {
+        return _tilesx;
+    }
+
+    int getTilesY() const {
+        return _tilesy;
+    }
+
+    int getCellTilesX() const {
+        return _cell_tilesx;
+    }
+
+    int getCellTilesY() const {
+        return _cell_tilesy;
+    }
+
+    // tile column and row of a pixel
+    int tileX(int x) const {
+        return x / _cellx * _cell_tilesx + x % _cellx / TILE_SIZE;
+    }
+
+    int tileY(int y) const {
+        return y / _celly * _cell_tilesy + y % _celly / TILE_SIZE;
+    }
+
+    // pixel rect of a tile, clipped to its cell
+    SDL_Rect tileRect(int tx, int ty) const {
+        int lx = tx % _cell_tilesx * TILE_SIZE, ly = ty % _cell_tilesy * TILE_SIZE;
+        return SDL_Rect{tx / _cell_tilesx * _cellx + lx, ty / _cell_tilesy * _celly + ly,
+                        std::min(TILE_SIZE, _cellx - lx), std::min(TILE_SIZE, _celly - ly)};
+    }
+};
+
+// One bit per tile of a TileGrid
+class TileMask : public TileGrid {
+    std::vector<bool> _bits;
+    bool _any = false;
+
+public:
+    TileMask(int dimx=0, int dimy=0, int cellx=0, int celly=0)
+        : TileGrid(dimx, dimy, cellx, celly), _bits(_tilesx * _tilesy) { }
+
+    bool any() const {
+        return _any;
+    }
+
+    bool test(int tx, int ty) const {
+        return _bits[tx + ty * _tilesx];
+    }
+
+    void mark(int tx, int ty) {
+        _bits[tx + ty * _tilesx] = true;
+        _any = true;
+    }
+
+    // b is in pixels
+    void mark(const Bounds &b) {
+        auto c = b.clipped(_dimx, _dimy);
+        if (c.empty()) {
+            return;
+        }
+        for (int ty = tileY(c.y0); ty <= tileY(c.y1); ++ty) {
+            for (int tx = tileX(c.x0); tx <= tileX(c.x1); ++tx) {
+                _bits[tx + ty * _tilesx] = true;
+            }
+        }
+        _any = true;
+    }
+
+    void markAll() {
+        std::fill(_bits.begin(), _bits.end(), true);
+        _any = !_bits.empty();
+    }
+
+    void clear() {
+        if (_any) {
+            std::fill(_bits.begin(), _bits.end(), false);
+            _any = false;
+        }
+    }
+
+    template<typename F>
+    void forEachTile(F fn) const {
+        if (!_any) {
+            return;
+        }
+        for (int ty = 0; ty < _tilesy; ++ty) {
+            for (int tx = 0; tx < _tilesx; ++tx) {
+                if (test(tx, ty)) {
+                    fn(tx, ty);
+                }
+            }
+        }
+    }
+
+    // calls fn with the pixel rect of every horizontal run of marked tiles
+    template<typename F>
+    void forEachSpan(F fn) const {
+        if (!_any) {
+            return;
+        }
+        for (int ty = 0; ty < _tilesy; ++ty) {
+            int tx = 0;
+            while (tx < _tilesx) {
+                if (!test(tx, ty)) {
+                    ++tx;
+                    continue;
+                }
+                int end = tx;
+                while (end < _tilesx && test(end, ty)) {
+                    ++end;
+                }
+                auto first = tileRect(tx, ty), last = tileRect(end - 1, ty);
+                fn(SDL_Rect{first.x, first.y, last.x + last.w - first.x, first.h});
+                tx = end;
+            }
+        }
+    }
+};
+
+#endif
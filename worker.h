@@ -0,0 +1,333 @@
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Background threads running submitted jobs, one per core but the one
+// the UI runs on. Every thread has a queue of its own and steals from
+// the back of the others' when it runs dry. Higher priority jobs are
+// taken first wherever they are, and batch jobs never get all threads,
+// so interactive ones don't wait for an export to finish. Exports,
+// imports and the like run as batch jobs, see parallelFor.
+class Worker {
+public:
+    enum Priority { INTERACTIVE, BACKGROUND, BATCH, PRIORITIES };
+
+    // Jobs that haven't started when it's set are skipped, their future
+    // gets a default value. Running ones may check it themselves.
+    class Cancel {
+        std::atomic<bool> _cancelled{false};
+
+    public:
+        void cancel() {
+            _cancelled = true;
+        }
+
+        bool cancelled() const {
+            return _cancelled;
+        }
+    };
+    typedef std::shared_ptr<Cancel> CancelToken;
+
+    static CancelToken cancelToken() {
+        return std::make_shared<Cancel>();
+    }
+
+    struct Serial;
+
+    struct Job {
+        std::function<void(bool)> run;
+        Priority priority;
+        CancelToken cancel;
+        Serial *serial;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    // Jobs submitted with the same Serial run one at a time, in order
+    struct Serial {
+        std::mutex lock;
+        std::deque<Job> pending;
+        bool running = false;
+    };
+
+    struct Stats {
+        size_t queued = 0, running = 0, done = 0, cancelled = 0, stolen = 0;
+        // totals in seconds
+        double waited = 0, busy = 0;
+    };
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<Job> jobs[PRIORITIES];
+    };
+
+    struct Counters {
+        std::atomic<size_t> queued{0}, running{0}, done{0}, cancelled{0}, stolen{0};
+        std::atomic<long long> waited_us{0}, busy_us{0};
+    };
+
+    std::vector<std::thread> _threads;
+    std::vector<std::unique_ptr<Queue>> _queues;
+    Counters _counters[PRIORITIES];
+    std::mutex _lock;
+    std::condition_variable _cv;
+    // bumped under _lock whenever there's something new to take
+    std::atomic<size_t> _signals{0};
+    // submitted and not done yet, those waiting on a Serial included
+    std::atomic<size_t> _outstanding{0};
+    std::atomic<size_t> _next_queue{0};
+    bool _done = false;
+
+    struct Current {
+        const Worker *worker = nullptr;
+        int index = -1;
+    };
+
+    static Current &_current() {
+        static thread_local Current current;
+        return current;
+    }
+
+    // wakes everyone, the destructor waits on the same condition
+    void _signal() {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            ++_signals;
+        }
+        _cv.notify_all();
+    }
+
+    template<typename R, typename F>
+    static void _fulfil(std::promise<R> &promise, F &fn, bool skip) {
+        promise.set_value(skip ? R() : fn());
+    }
+
+    template<typename F>
+    static void _fulfil(std::promise<void> &promise, F &fn, bool skip) {
+        if (!skip) {
+            fn();
+        }
+        promise.set_value();
+    }
+
+    void _push(Job job) {
+        auto &current = _current();
+        auto &queue = *_queues[current.worker == this ? current.index : _next_queue++ % _queues.size()];
+        _counters[job.priority].queued++;
+        {
+            std::lock_guard<std::mutex> lock(queue.lock);
+            queue.jobs[job.priority].push_back(std::move(job));
+        }
+        _signal();
+    }
+
+    // the front of our own queue or the back of someone else's
+    bool _take(int index, Job &job) {
+        int n = _queues.size();
+        for (int p = 0; p < PRIORITIES; ++p) {
+            if (p == BATCH && n > 1 && _counters[BATCH].running >= (size_t)n - 1) {
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                auto &queue = *_queues[(index + i) % n];
+                std::lock_guard<std::mutex> lock(queue.lock);
+                auto &jobs = queue.jobs[p];
+                if (jobs.empty()) {
+                    continue;
+                }
+                if (i == 0) {
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                } else {
+                    job = std::move(jobs.back());
+                    jobs.pop_back();
+                    _counters[p].stolen++;
+                }
+                _counters[p].queued--;
+                _counters[p].running++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void _execute(Job &job) {
+        auto &counters = _counters[job.priority];
+        auto start = std::chrono::steady_clock::now();
+        bool skip = job.cancel && job.cancel->cancelled();
+        job.run(skip);
+        auto end = std::chrono::steady_clock::now();
+        counters.waited_us += std::chrono::duration_cast<std::chrono::microseconds>(start - job.queued).count();
+        counters.busy_us += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        (skip ? counters.cancelled : counters.done)++;
+        counters.running--;
+        if (job.priority == BATCH) {
+            // a batch job may have been waiting for a thread
+            _signal();
+        }
+        if (job.serial) {
+            // the next one in line goes to the pool before this one counts as done
+            std::lock_guard<std::mutex> lock(job.serial->lock);
+            if (job.serial->pending.empty()) {
+                job.serial->running = false;
+            } else {
+                auto next = std::move(job.serial->pending.front());
+                job.serial->pending.pop_front();
+                _push(std::move(next));
+            }
+        }
+        if (--_outstanding == 0) {
+            _signal();
+        }
+    }
+
+    void _run(int index) {
+        _current().worker = this;
+        _current().index = index;
+        while (true) {
+            size_t seen = _signals;
+            Job job;
+            if (_take(index, job)) {
+                _execute(job);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(_lock);
+            if (_done) {
+                return;
+            }
+            _cv.wait(lock, [&] { return _done || _signals != seen; });
+        }
+    }
+
+public:
+    Worker(int threads=0) {
+        if (threads <= 0) {
+            threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+        }
+        for (int i = 0; i < threads; ++i) {
+            _queues.emplace_back(new Queue);
+        }
+        for (int i = 0; i < threads; ++i) {
+            _threads.emplace_back(&Worker::_run, this, i);
+        }
+    }
+
+    // finishes whatever is queued
+    ~Worker() {
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _cv.wait(lock, [this] { return _outstanding == 0; });
+            _done = true;
+        }
+        _cv.notify_all();
+        for (auto &thread : _threads) {
+            thread.join();
+        }
+    }
+
+    int getThreadCount() const {
+        return _threads.size();
+    }
+
+    Stats getStats(Priority priority) const {
+        auto &counters = _counters[priority];
+        Stats res;
+        res.queued = counters.queued;
+        res.running = counters.running;
+        res.done = counters.done;
+        res.cancelled = counters.cancelled;
+        res.stolen = counters.stolen;
+        res.waited = counters.waited_us / 1e6;
+        res.busy = counters.busy_us / 1e6;
+        return res;
+    }
+
+    template<typename F>
+    auto submit(F fn, Priority priority=BACKGROUND, CancelToken cancel=nullptr, Serial *serial=nullptr)
+            -> std::future<decltype(fn())> {
+        auto promise = std::make_shared<std::promise<decltype(fn())>>();
+        auto res = promise->get_future();
+        Job job;
+        job.run = [promise, fn](bool skip) mutable {
+            // a throwing job must not take the worker thread down, the
+            // waiter gets the exception from get() instead
+            try {
+                _fulfil(*promise, fn, skip);
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        };
+        job.priority = priority;
+        job.cancel = std::move(cancel);
+        job.serial = serial;
+        job.queued = std::chrono::steady_clock::now();
+        ++_outstanding;
+        if (serial) {
+            std::lock_guard<std::mutex> lock(serial->lock);
+            if (serial->running) {
+                serial->pending.push_back(std::move(job));
+                return res;
+            }
+            serial->running = true;
+        }
+        _push(std::move(job));
+        return res;
+    }
+
+    // Runs fn(i) for every i in 0..count-1 on the pool, the calling thread
+    // lending a hand, and returns once all are done. Helpers that only get
+    // to start after that find nothing left. The first exception fn threw
+    // is rethrown here.
+    template<typename F>
+    void parallelFor(int count, F fn, Priority priority=BATCH) {
+        struct Loop {
+            std::atomic<int> next{0};
+            std::mutex lock;
+            std::condition_variable cv;
+            int done = 0;
+            std::exception_ptr error;
+        };
+        auto loop = std::make_shared<Loop>();
+        auto body = [loop, count, &fn] {
+            for (int i = loop->next++; i < count; i = loop->next++) {
+                std::exception_ptr error;
+                try {
+                    fn(i);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(loop->lock);
+                if (error && !loop->error) {
+                    loop->error = error;
+                }
+                if (++loop->done == count) {
+                    loop->cv.notify_all();
+                }
+            }
+        };
+        for (int t = 1; t < std::min(count, getThreadCount() + 1); ++t) {
+            submit(body, priority);
+        }
+        body();
+        std::unique_lock<std::mutex> lock(loop->lock);
+        loop->cv.wait(lock, [&] { return loop->done >= count; });
+        if (loop->error) {
+            std::rethrow_exception(loop->error);
+        }
+    }
+};
+
+#endif